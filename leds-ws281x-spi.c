@@ -2,342 +2,3330 @@
 /*
  * Copyright (C) 2025 Chris Morgan <macromorgan@hotmail.com>
  *
- * Driver for controlling one or more WS2812B LEDs over SPI.
- * This driver works by sending SPI packets with precise timing
- * that are able to effectively emulate the signals required by
+ * Driver for controlling one or more WS2812B LEDs over SPI or UART.
+ * This driver works by sending SPI packets (or UART frames) with precise
+ * timing that are able to effectively emulate the signals required by
  * the LED controller.
  *
  * Datasheet: https://cdn-shop.adafruit.com/datasheets/WS2812B.pdf
  *
  */
 
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/atomic.h>
+#include <linux/average.h>
+#include <linux/bitmap.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/dma-fence.h>
+#include <linux/file.h>
+#include <linux/hrtimer.h>
+#include <linux/io_uring/cmd.h>
+#include <linux/kref.h>
 #include <linux/led-class-multicolor.h>
 #include <linux/leds.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/seq_file.h>
+#include <linux/serdev.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
+#include <linux/sync_file.h>
+#include <linux/unaligned.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "ws281x.h"
+
+/* Number of records kept in the trace ring of an array. */
+#define WS281X_TRACE_LEN		4096
+
+/* Number of suspect transfers in a row before falling back. */
+#define WS281X_SUSPECT_RUN		3
+
+/* Number of LEDs in the synthetic frame used to time the encoders. */
+#define WS281X_BENCH_LEDS		256
+
+/* Time spent encoding the synthetic frame with each encoder. */
+#define WS281X_BENCH_NS			NSEC_PER_MSEC
+
+struct ws281x_encoder;
 
 /**
  * struct ws281x_info - Chip specific information. This information may
  *	vary depending upon different ws281x controllers.
  *
- * @zero_val: SPI byte interpreted as 0 by ws281x hardware.
- * @one_val: SPI byte interpreted as 1 by ws281x hardware.
- * @write_freq: SPI write frequency required for ws281x hardware.
- * Should be 8x the frequency of the specific chip (typically 400Khz
- * or 800Khz).
- * @subpixel_sz: Length in bits of subpixel data.
+ * @sym_lut: Wire bytes interpreted by ws281x hardware as a group of
+ * @bits_per_sym bits, indexed by the value of those bits (MSB first).
+ * @bits_per_sym: Number of ws281x bits carried by a single wire byte.
+ * @write_freq: SPI write frequency (or UART baud rate) required for
+ * ws281x hardware. For SPI this should be 8x the frequency of the
+ * specific chip (typically 400Khz or 800Khz).
+ * @frame_bits: Number of bus bit times taken to send each wire byte.
+ * @subpixel_sz: Length in bytes of formatted subpixel data. Should be
+ * (BITS_PER_BYTE / bits_per_sym).
  * @ch_per_led: Number of subpixels. Should be 3 (RGB) or 4 (RGBW).
  * @pixel_sz: Total size of pixel information. Should be
  * (subpixel_sz * ch_per_led).
+ * @fallback: Optional encoding using fewer wire bytes, used when the bus
+ * can not keep up with this one.
+ * @name: Name of the encoding, used in log messages.
+ * @encoder: Fastest encoder for this encoding on this CPU, chosen when
+ * the module is loaded.
  */
 struct ws281x_chipinfo {
-	u8				zero_val;
-	u8				one_val;
+	const u8			*sym_lut;
+	u8				bits_per_sym;
 	u32				write_freq;
+	u8				frame_bits;
 	u8				subpixel_sz;
 	u8				ch_per_led;
 	u8				pixel_sz;
+	const struct ws281x_chipinfo	*fallback;
+	const char			*name;
+	const struct ws281x_encoder	*encoder;
+};
+
+DECLARE_EWMA(ws281x_us, 4, 4)
+
+/**
+ * struct ws281x_enc_table - Encoding of every subpixel value.
+ *
+ * @info: Chip specific information the table encodes for.
+ * @gen: Generation of the table, increased each time one is published.
+ * @legal: Bitmap of the wire bytes that are symbols of @info.
+ * @enc: Encoder used with this table.
+ * @level: Each 8-bit subpixel value with the master brightness of the
+ * array applied.
+ * @wire: Formatted subpixel data for each 8-bit subpixel value, with the
+ * master brightness of the array applied.
+ * @rcu: RCU head used to free the table once no encoder uses it.
+ *
+ * Tables are published through RCU so that they can be rebuilt and
+ * swapped in at any time while the encoder keeps using the table it
+ * started with.
+ */
+struct ws281x_enc_table {
+	const struct ws281x_chipinfo	*info;
+	u32				gen;
+	DECLARE_BITMAP(legal, 256);
+	const struct ws281x_encoder	*enc;
+	u8				level[256];
+	u8				wire[256][BITS_PER_BYTE];
+	struct rcu_head			rcu;
+};
+
+/**
+ * struct ws281x_encoder - Implementation of the pixelstream encoder.
+ *
+ * @name: Name of the encoder, used to log and to override the choice.
+ * @usable: Optional check that the encoder supports an encoding.
+ * @encode: Encode @count LEDs starting at @colors into @buf.
+ *
+ * Encoders rank differently from one CPU to another, so each of them is
+ * timed on a synthetic frame when the module is loaded and the fastest
+ * one is used for each encoding.
+ */
+struct ws281x_encoder {
+	const char			*name;
+	bool				(*usable)(const struct ws281x_chipinfo *info);
+	void				(*encode)(const struct ws281x_enc_table *table,
+						  u8 *buf, const u8 *colors,
+						  u32 count);
 };
 
 /**
- * struct ws281x_led - Per LED data structure.
+ * struct ws281x_led - Per LED (or LED segment) data structure.
  *
  * @parent: Pointer to ws281x_array struct.
+ * @first: Index of the first LED in the array controlled by @led.
+ * @count: Number of consecutive LEDs controlled by @led.
+ * @priority: True when changes to @led must bypass coalescing.
  * @led: led_classdev_mc struct containing LED specific info.
  */
 struct ws281x_led {
 	struct ws281x_array		*parent;
+	u32				first;
+	u32				count;
+	bool				priority;
 	struct led_classdev_mc		led;
 };
 
+/**
+ * struct ws281x_part - Character device giving access to a range of
+ * LEDs of the array as a frame of colors.
+ *
+ * @parent: Pointer to ws281x_array struct.
+ * @misc: miscdevice of the character device.
+ * @ref: Reference count, held by the array and by each open file.
+ * @lock: Read-write semaphore held for reading by file operations and
+ * for writing while the frame is unregistered.
+ * @gone: True once the array the frame belongs to was unbound.
+ * @first: Index of the first LED of the array in the frame.
+ * @count: Number of LEDs in the frame.
+ * @width: Number of LEDs per row when the frame is used as a matrix.
+ * @height: Number of rows when the frame is used as a matrix.
+ * @serpentine: True when every other row of the matrix runs backwards.
+ * @colors: Frame buffer, in the same layout as the colors of the array,
+ * that userspace writes or maps before committing it to the array.
+ * @raw: Staging buffer for raw wire data, in the same layout as the
+ * pixelstream of the array.
+ * @timeline: Timeline of the out-fences of the frame.
+ * @fence_mutex: Mutex keeping the seqnos of the out-fences in the order
+ * their commits are queued.
+ * @fence_lock: Spinlock protecting @fence_waits.
+ * @fence_waits: Fenced commits, in the order they were submitted.
+ * @fence_work: Work item committing the frame for the commits at the
+ * head of @fence_waits whose in-fence signaled.
+ */
+struct ws281x_part {
+	struct ws281x_array		*parent;
+	struct miscdevice		misc;
+	struct kref			ref;
+	struct rw_semaphore		lock;
+	bool				gone;
+	u32				first;
+	u32				count;
+	u32				width;
+	u32				height;
+	bool				serpentine;
+	u8				*colors;
+	u8				*raw;
+	struct ws281x_timeline		*timeline;
+	struct mutex			fence_mutex;
+	spinlock_t			fence_lock;
+	struct list_head		fence_waits;
+	struct work_struct		fence_work;
+};
+
+/**
+ * struct ws281x_latch - Completion of a commit once the flush carrying it
+ * was latched by the LEDs.
+ *
+ * @node: Entry in the list of commits waiting for the next flush.
+ * @done: Called with the result of the flush once it was latched.
+ */
+struct ws281x_latch {
+	struct list_head		node;
+	void				(*done)(struct ws281x_latch *latch,
+						int error);
+};
+
+/**
+ * struct ws281x_timeline - Timeline of the out-fences of a frame.
+ *
+ * The out-fences outlive the frame (and the array) through the sync_file
+ * fds handed to userspace, so the lock they use is refcounted on its own
+ * and only freed once the frame and its last fence are gone.
+ *
+ * @ref: Reference count, held by the frame and by each of its fences.
+ * @lock: Spinlock used by the fences.
+ * @context: Fence context of the frame.
+ * @seqno: Seqno of the last fence of the frame.
+ */
+struct ws281x_timeline {
+	struct kref			ref;
+	spinlock_t			lock;
+	u64				context;
+	u64				seqno;
+};
+
+/**
+ * struct ws281x_fence - Fence signaled once a commit was latched by the
+ * LEDs.
+ *
+ * @base: dma_fence handed to userspace through a sync_file.
+ * @latch: Completion signaling @base.
+ * @timeline: Timeline owning the lock of @base.
+ */
+struct ws281x_fence {
+	struct dma_fence		base;
+	struct ws281x_latch		latch;
+	struct ws281x_timeline		*timeline;
+};
+
+/**
+ * struct ws281x_uring_pdu - Per command data of an io_uring command.
+ *
+ * @latch: Completion posting the command once the commit was latched.
+ * @error: Result the command completes with.
+ */
+struct ws281x_uring_pdu {
+	struct ws281x_latch		latch;
+	int				error;
+};
+
+/**
+ * struct ws281x_fence_wait - Fenced commit of a frame.
+ *
+ * @part: Frame to commit.
+ * @in: Optional fence to wait for before committing.
+ * @cb: Callback run when @in signals.
+ * @out: Optional fence to signal once the commit was latched.
+ * @node: Entry in the fence_waits list of @part.
+ * @ready: True once @in signaled, or from the start without @in.
+ */
+struct ws281x_fence_wait {
+	struct ws281x_part		*part;
+	struct dma_fence		*in;
+	struct dma_fence_cb		cb;
+	struct ws281x_fence		*out;
+	struct list_head		node;
+	bool				ready;
+};
+
+/**
+ * struct ws281x_stripe - Contiguous span of the array driven by its own
+ * SPI device.
+ *
+ * @spi: Pointer to SPI device driving the span.
+ * @first: Index of the first LED of the span in the array.
+ * @count: Number of LEDs in the span.
+ * @msg: SPI message used to send the span.
+ * @xfer: SPI transfer used to send the span.
+ * @queued: Whether the span of the frame being sent was already started.
+ */
+struct ws281x_stripe {
+	struct spi_device		*spi;
+	u32				first;
+	u32				count;
+	struct spi_message		msg;
+	struct spi_transfer		xfer;
+	bool				queued;
+};
+
 /**
  * struct ws281x_array - ws281x private driver information containing
  * info required by driver at runtime.
  *
  * @dev: Pointer to device for this hardware.
  * @spi: Pointer to SPI device used for control signals.
+ * @serdev: Pointer to serdev device used for control signals.
+ * @xfer: Transport specific function used to send the pixelstream.
  * @mutex: Mutex used to keep writes ordered.
- * @info: Pointer to hardware specific information.
+ * @info: Pointer to hardware specific information the pixelstream is
+ * currently encoded for.
+ * @table: Encoding table used by the encoder.
+ * @table_lock: Mutex serializing the rebuilds of @table.
+ * @table_info: Pointer to hardware specific information @table should
+ * encode for.
+ * @table_gen: Generation of the latest published @table.
+ * @enc_gen: Generation of the table the pixelstream is encoded with.
+ * @master_brightness: Scale applied to every subpixel value by @table.
+ * @encoder: Encoder forced through debugfs, NULL to use the fastest one.
  * @pixelstream: Pointer to buffer which stores the stream of specially
  * formatted data written directly to the SPI hardware.
- * @num_leds: Number of controllable LEDs.
- * @leds: Array of individual LED structs.
+ * @colors: Pointer to buffer which stores the color of each LED, as
+ * ch_per_led bytes in red, green, blue order.
+ * @num_leds: Number of physical LEDs in the array.
+ * @num_segs: Number of LED class devices registered for the array.
+ * @num_stripes: Number of spans the array is split in.
+ * @stripes: Spans of the array, the first one driven by @spi.
+ * @xfer_pending: Number of stripes still being sent.
+ * @xfer_done: Completion signalled once every stripe has been sent.
+ * @flush_work: Work item that encodes and sends the colors to the LEDs.
+ * @flush_timer: Timer that queues @flush_work once the coalescing window
+ * has passed.
+ * @fallback_work: Work item that switches the array to the fallback
+ * encoding of its chip.
+ * @dirty: True when the colors changed since the last flush.
+ * @flush_error: Error of the last failed flush, reported by the next
+ * brightness change.
+ * @dirty_map: Bitmap of the LEDs whose color changed since the last flush.
+ * @raw_map: Bitmap of the LEDs whose pixelstream holds raw wire data
+ * written by userspace instead of their encoded color.
+ * @last_arrival: Time at which the colors were last changed.
+ * @arrival_avg: Running average of the time between color changes.
+ * @frame_avg: Running average of the time taken by a flush.
+ * @window_us: Coalescing window chosen for the last color change.
+ * @debugfs: debugfs directory of the array.
+ * @dry_run: True to skip the bus and only wait for the time a transfer
+ * would take.
+ * @first_dirty: Time of the oldest color change not yet flushed.
+ * @stat_ops: Number of color changes.
+ * @stat_flushes: Number of flushes sent to the LEDs.
+ * @stat_latency_us: Total time from a first change to its flush.
+ * @stat_latency_max_us: Longest time from a first change to its flush.
+ * @trace_lock: Spinlock protecting the trace ring.
+ * @trace: Ring of WS281X_TRACE_LEN trace records, NULL when disabled.
+ * @trace_head: Number of records written to @trace.
+ * @trace_tail: Number of records read from @trace.
+ * @achieved_bps: Bus bit rate achieved by the last transfer.
+ * @stat_suspect: Number of transfers that took long enough for the LEDs
+ * to have latched part of the frame.
+ * @suspect_run: Number of suspect transfers in a row.
+ * @suspect_slack_us: Time a transfer may take on top of its theoretical
+ * duration before it is considered suspect.
+ * @auto_fallback: True to switch to the fallback encoding of the chip
+ * after WS281X_SUSPECT_RUN suspect transfers in a row.
+ * @latches: Commits to complete once the next flush is latched.
+ * @leds: Array of individual LED (or LED segment) structs.
  */
 struct ws281x_array {
 	struct device			*dev;
 	struct spi_device		*spi;
+	struct serdev_device		*serdev;
+	int				(*xfer)(struct ws281x_array *ws281x,
+						size_t len);
 	struct mutex			mutex;
 	const struct ws281x_chipinfo	*info;
+	struct ws281x_enc_table __rcu	*table;
+	struct mutex			table_lock;
+	const struct ws281x_chipinfo	*table_info;
+	u32				table_gen;
+	u32				enc_gen;
+	u8				master_brightness;
+	const struct ws281x_encoder	*encoder;
 	unsigned char			*pixelstream;
+	u8				*colors;
 	u32				num_leds;
-	struct ws281x_led		leds[] __counted_by(num_leds);
+	u32				num_segs;
+	u32				num_stripes;
+	struct ws281x_stripe		*stripes;
+	atomic_t			xfer_pending;
+	struct completion		xfer_done;
+	struct work_struct		flush_work;
+	struct hrtimer			flush_timer;
+	struct work_struct		fallback_work;
+	bool				dirty;
+	int				flush_error;
+	unsigned long			*dirty_map;
+	unsigned long			*raw_map;
+	ktime_t				last_arrival;
+	struct ewma_ws281x_us		arrival_avg;
+	struct ewma_ws281x_us		frame_avg;
+	u32				window_us;
+	struct dentry			*debugfs;
+	bool				dry_run;
+	ktime_t				first_dirty;
+	u64				stat_ops;
+	u64				stat_flushes;
+	u64				stat_latency_us;
+	u64				stat_latency_max_us;
+	spinlock_t			trace_lock;
+	struct ws281x_trace_rec		*trace;
+	u32				trace_head;
+	u32				trace_tail;
+	u32				achieved_bps;
+	u64				stat_suspect;
+	u32				suspect_run;
+	u32				suspect_slack_us;
+	bool				auto_fallback;
+	struct list_head		latches;
+	struct ws281x_led		leds[] __counted_by(num_segs);
 };
 
 /**
  * ws281x_format_subpixel() - format the subpixel data
- * @ws281x: Driver data.
+ * @info: Chip specific information.
  * @subpixel_buf: A pre-allocated buffer to contain formatted subpixel
  * data
  * @pixel: An 8-bit subpixel value.
  *
  * Convert the 8 bit subpixel value into a packet that can be
- * understood by the ws821x starting with the MSB.
+ * understood by the ws821x starting with the MSB. Each byte of the
+ * packet is looked up from the chip's symbol table using the next
+ * bits_per_sym bits of the subpixel value.
  */
-static void ws281x_format_subpixel(struct ws281x_array *ws281x,
+static void ws281x_format_subpixel(const struct ws281x_chipinfo *info,
 				   char *subpixel_buf, unsigned char pixel)
 {
 	int i = 0;
 
-	for (i = 0; i < ws281x->info->subpixel_sz; i++) {
-		subpixel_buf[i] = (pixel & 0x80) ? \
-			ws281x->info->one_val : ws281x->info->zero_val;
-		pixel <<= 1;
+	for (i = 0; i < info->subpixel_sz; i++) {
+		subpixel_buf[i] = info->sym_lut[pixel >>
+				  (BITS_PER_BYTE - info->bits_per_sym)];
+		pixel <<= info->bits_per_sym;
+	}
+}
+
+/* The ws2812b requires data in green, red, blue order. */
+static const u8 ws2812_grb[] = { 1, 0, 2 };
+
+/*
+ * Shift each subpixel out a group of bits at a time, looking up the wire
+ * byte of each group.
+ */
+static void ws281x_encode_scalar(const struct ws281x_enc_table *table,
+				 u8 *buf, const u8 *colors, u32 count)
+{
+	const struct ws281x_chipinfo *info = table->info;
+	u32 i, j;
+
+	for (i = 0; i < count; i++, colors += info->ch_per_led) {
+		for (j = 0; j < ARRAY_SIZE(ws2812_grb); j++) {
+			ws281x_format_subpixel(info, buf,
+					       table->level[colors[ws2812_grb[j]]]);
+			buf += info->subpixel_sz;
+		}
+	}
+}
+
+/* Copy the formatted data of each subpixel from the table. */
+static void ws281x_encode_table(const struct ws281x_enc_table *table,
+				u8 *buf, const u8 *colors, u32 count)
+{
+	const struct ws281x_chipinfo *info = table->info;
+	u32 i, j;
+
+	for (i = 0; i < count; i++, colors += info->ch_per_led) {
+		for (j = 0; j < ARRAY_SIZE(ws2812_grb); j++) {
+			memcpy(buf, table->wire[colors[ws2812_grb[j]]],
+			       info->subpixel_sz);
+			buf += info->subpixel_sz;
+		}
+	}
+}
+
+static __always_inline void ws281x_encode_words(const struct ws281x_enc_table *table,
+						u8 *buf, const u8 *colors,
+						u32 count, const size_t sz)
+{
+	u8 ch = table->info->ch_per_led;
+	u32 i, j;
+
+	for (i = 0; i < count; i++, colors += ch) {
+		for (j = 0; j < ARRAY_SIZE(ws2812_grb); j++, buf += sz)
+			memcpy(buf, table->wire[colors[ws2812_grb[j]]], sz);
+	}
+}
+
+static bool ws281x_word_usable(const struct ws281x_chipinfo *info)
+{
+	return info->subpixel_sz == sizeof(u64) ||
+	       info->subpixel_sz == sizeof(u32);
+}
+
+/*
+ * Like the table encoder, but with the subpixel size known at compile
+ * time so that each subpixel is moved as a single word.
+ */
+static void ws281x_encode_word(const struct ws281x_enc_table *table,
+			       u8 *buf, const u8 *colors, u32 count)
+{
+	if (table->info->subpixel_sz == sizeof(u64))
+		ws281x_encode_words(table, buf, colors, count, sizeof(u64));
+	else
+		ws281x_encode_words(table, buf, colors, count, sizeof(u32));
+}
+
+static bool ws281x_spread_usable(const struct ws281x_chipinfo *info)
+{
+	return info->bits_per_sym == 1 && info->subpixel_sz == sizeof(u64);
+}
+
+/*
+ * Spread the bits of each subpixel over the bytes of a 64-bit word with a
+ * multiply, the MSB in the first byte, turn each byte into an all-ones or
+ * all-zeroes mask and select the wire byte of each bit with it. None of
+ * the bytes exceeds 0x80 after the first mask, so adding 0x7f to them
+ * can not carry into the next one.
+ */
+static void ws281x_encode_spread(const struct ws281x_enc_table *table,
+				 u8 *buf, const u8 *colors, u32 count)
+{
+	const struct ws281x_chipinfo *info = table->info;
+	u64 lo = info->sym_lut[0] * 0x0101010101010101ULL;
+	u64 hi = info->sym_lut[1] * 0x0101010101010101ULL;
+	u64 bits;
+	u32 i, j;
+
+	for (i = 0; i < count; i++, colors += info->ch_per_led) {
+		for (j = 0; j < ARRAY_SIZE(ws2812_grb); j++) {
+			bits = table->level[colors[ws2812_grb[j]]] *
+			       0x0101010101010101ULL;
+			bits &= 0x0102040810204080ULL;
+			bits = ((bits + 0x7f7f7f7f7f7f7f7fULL) &
+				0x8080808080808080ULL) >> 7;
+			put_unaligned_le64(lo ^ ((lo ^ hi) & (bits * 0xff)),
+					   buf);
+			buf += sizeof(u64);
+		}
 	}
 }
 
+static const struct ws281x_encoder ws281x_encoders[] = {
+	{ .name = "scalar", .encode = ws281x_encode_scalar },
+	{ .name = "table", .encode = ws281x_encode_table },
+	{
+		.name = "word",
+		.usable = ws281x_word_usable,
+		.encode = ws281x_encode_word,
+	},
+	{
+		.name = "spread",
+		.usable = ws281x_spread_usable,
+		.encode = ws281x_encode_spread,
+	},
+};
+
+static bool ws281x_encoder_usable(const struct ws281x_encoder *enc,
+				  const struct ws281x_chipinfo *info)
+{
+	return !enc->usable || enc->usable(info);
+}
+
+static const struct ws281x_encoder *ws281x_find_encoder(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ws281x_encoders); i++)
+		if (sysfs_streq(name, ws281x_encoders[i].name))
+			return &ws281x_encoders[i];
+
+	return NULL;
+}
+
 /**
- * ws2812_format_pixel_grb() - combine r, g, and b values into a single
- * packet
- * @ws281x: Driver data.
- * @pixel_buf: A pre-allocated buffer to contain formatted pixel
- * data
- * @r: An 8-bit subpixel value for red.
- * @g: An 8-bit subpixel value for green.
- * @b: An 8-bit subpixel value for blue.
- *
- * Convert the 3 subpixel values into a full pixel packet that can be
- * understood by the ws821x. The ws2812b requires data in green, red,
- * blue order.
+ * ws281x_fill_table() - Fill an encoding table
+ * @table: Table to fill.
+ * @info: Chip specific information to encode for.
+ * @brightness: Scale applied to every subpixel value.
  */
-static void ws2812_format_pixel_grb(struct ws281x_array *ws281x,
-				    unsigned char *pixel_buf,
-				    unsigned char g, unsigned char r,
-				    unsigned char b)
+static void ws281x_fill_table(struct ws281x_enc_table *table,
+			      const struct ws281x_chipinfo *info,
+			      u8 brightness)
 {
-	ws281x_format_subpixel(ws281x, pixel_buf, g);
-	pixel_buf += ws281x->info->subpixel_sz;
-	ws281x_format_subpixel(ws281x, pixel_buf, r);
-	pixel_buf += ws281x->info->subpixel_sz;
-	ws281x_format_subpixel(ws281x, pixel_buf, b);
+	int i;
+
+	table->info = info;
+	table->enc = info->encoder;
+	bitmap_zero(table->legal, 256);
+	for (i = 0; i < BIT(info->bits_per_sym); i++)
+		__set_bit(info->sym_lut[i], table->legal);
+
+	for (i = 0; i < ARRAY_SIZE(table->wire); i++) {
+		table->level[i] = DIV_ROUND_CLOSEST(i * brightness, LED_FULL);
+		ws281x_format_subpixel(info, table->wire[i], table->level[i]);
+	}
 }
 
 /**
- * ws281x_write() - Write the active pixel buffer via SPI to the LEDs
+ * ws281x_build_table() - Build and publish a new encoding table
  * @ws281x: Driver data.
  *
- * Write the active pixelstream from the driver data to the LEDs via
- * the SPI bus to update the LEDs.
+ * Build a table for the current table_info, master brightness and
+ * encoder of the array and swap it in for the encoder, then queue a
+ * flush so the whole pixelstream gets encoded with it. This never waits
+ * for a flush in progress, which keeps using the previous table until
+ * it is done.
+ *
+ * Must be called with the table_lock held.
  *
  * Return: 0 on success or error on failure.
  */
-static int ws281x_write(struct ws281x_array *ws281x)
+static int ws281x_build_table(struct ws281x_array *ws281x)
 {
-	struct spi_device *spi = ws281x->spi;
-	struct spi_message spi_msg;
-	struct spi_transfer xfers;
-	int ret;
+	struct ws281x_enc_table *table, *old;
 
-	spi_message_init(&spi_msg);
-	memset(&xfers, 0, sizeof(xfers));
+	table = kmalloc(sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
 
-	xfers.tx_buf = ws281x->pixelstream;
-	xfers.len = (ws281x->info->pixel_sz * ws281x->num_leds);
-	spi_message_add_tail(&xfers, &spi_msg);
+	ws281x_fill_table(table, ws281x->table_info,
+			  ws281x->master_brightness);
+	if (ws281x->encoder &&
+	    ws281x_encoder_usable(ws281x->encoder, table->info))
+		table->enc = ws281x->encoder;
 
-	ret = spi_sync(spi, &spi_msg);
-	if (ret) {
-		dev_err(ws281x->dev, "spi transfer error: %d", ret);
-		return ret;
-	}
+	table->gen = ws281x->table_gen + 1;
+	old = rcu_replace_pointer(ws281x->table, table,
+				  lockdep_is_held(&ws281x->table_lock));
+	WRITE_ONCE(ws281x->table_gen, table->gen);
+	if (old)
+		kfree_rcu(old, rcu);
 
-	/*
-	 * Sleep for at least 50us so the hardware knows this is the
-	 * end of a transfer.
-	 */
-	usleep_range(50, 200);
+	queue_work(system_highpri_wq, &ws281x->flush_work);
 
 	return 0;
 }
 
 /**
- * ws281x_update_pixelstream() - Update the pixelstream data to write
- * for the LEDs.
+ * ws281x_stripe_leds() - Number of LEDs a stripe sends for a frame
+ * @stripe: Span of the array.
+ * @count: Number of LEDs of the array to send, starting from the first.
+ *
+ * Return: Number of LEDs of the span to send.
+ */
+static u32 ws281x_stripe_leds(const struct ws281x_stripe *stripe, u32 count)
+{
+	if (count <= stripe->first)
+		return 0;
+
+	return min(count - stripe->first, stripe->count);
+}
+
+/**
+ * ws281x_wire_leds() - Number of LEDs sent back to back for a frame
  * @ws281x: Driver data.
+ * @count: Number of LEDs of the array to send, starting from the first.
  *
- * Iterate through every LED to write the appropriate values to the
- * pixelstream buffer inside the driver data.
+ * Stripes are sent in parallel, so the time taken by a frame is the time
+ * taken by the stripe sending the most LEDs.
  *
- * Return: 0 on success or error on failure.
+ * Return: Largest number of LEDs sent by a stripe.
  */
-static void ws281x_update_pixelstream(struct ws281x_array *ws281x)
+static u32 ws281x_wire_leds(struct ws281x_array *ws281x, u32 count)
 {
-	unsigned char *pixelstream = ws281x->pixelstream;
+	u32 leds = 0;
 	int i;
 
-	for (i = 0; i < ws281x->num_leds; i++) {
-		ws2812_format_pixel_grb(ws281x, pixelstream,
-				 ws281x->leds[i].led.subled_info[1].brightness,
-				 ws281x->leds[i].led.subled_info[0].brightness,
-				 ws281x->leds[i].led.subled_info[2].brightness);
-		pixelstream += ws281x->info->pixel_sz;
-	}
+	for (i = 0; i < ws281x->num_stripes; i++)
+		leds = max(leds, ws281x_stripe_leds(&ws281x->stripes[i], count));
+
+	return leds;
+}
+
+static void ws281x_spi_complete(void *context)
+{
+	struct ws281x_array *ws281x = context;
+
+	if (atomic_dec_and_test(&ws281x->xfer_pending))
+		complete(&ws281x->xfer_done);
 }
 
 /**
- * ws281x_brightness_set_blocking() - Update the subpixel data for an
- * LED
- * @dev: Pointer to led_classdev of LED being updated.
- * @brightness: Brightness value to write to LED.
+ * ws281x_spi_xfer() - Send the pixelstream via SPI
+ * @ws281x: Driver data.
+ * @len: Number of bytes of the pixelstream to send.
  *
- * Convert the brightness information into the individual color
- * components for the updated LED and update the LED with the required
- * values. Then, update the pixelstream with the data to format all LEDs.
- * Lastly, write the entire pixelstream to update the individual pixel that
- * has changed.
+ * Send the part of the pixelstream covered by each stripe on its own SPI
+ * device and wait for all of them to complete. The stripes are started
+ * longest first, and every shorter one is held back by the time its span
+ * is shorter, so that all the spans end, and latch, together to within
+ * the scheduling jitter of the starts.
  *
- * Return: 0 for success or error for failure.
+ * Return: 0 on success or error on failure.
  */
-static int ws281x_brightness_set_blocking(struct led_classdev *dev, enum led_brightness brightness)
+static int ws281x_spi_xfer(struct ws281x_array *ws281x, size_t len)
 {
-	struct led_classdev_mc *mc_cdev = lcdev_to_mccdev(dev);
-	struct ws281x_led *ws281x_led = container_of(mc_cdev, struct ws281x_led, led);
-	struct ws281x_array *ws281x = ws281x_led->parent;
+	u8 pixel_sz = ws281x->info->pixel_sz;
+	u32 freq = ws281x->info->write_freq;
+	struct ws281x_stripe *stripe, *next;
+	u32 count = len / pixel_sz;
+	unsigned int longest = 0;
+	ktime_t start, deadline;
+	s64 delay_us;
+	u64 lag;
+	u32 leds;
 	int ret = 0;
+	int i;
 
-	led_mc_calc_color_components(mc_cdev, brightness);
-	mutex_lock(&ws281x->mutex);
-	ws281x_update_pixelstream(ws281x);
-	ret = ws281x_write(ws281x);
-	mutex_unlock(&ws281x->mutex);
+	for (i = 0; i < ws281x->num_stripes; i++) {
+		stripe = &ws281x->stripes[i];
+		spi_message_init(&stripe->msg);
+		memset(&stripe->xfer, 0, sizeof(stripe->xfer));
+
+		leds = ws281x_stripe_leds(stripe, count);
+		if (!leds)
+			continue;
+
+		stripe->xfer.tx_buf = ws281x->pixelstream +
+				      (stripe->first * pixel_sz);
+		stripe->xfer.len = leds * pixel_sz;
+		stripe->xfer.speed_hz = freq;
+		spi_message_add_tail(&stripe->xfer, &stripe->msg);
+		stripe->msg.complete = ws281x_spi_complete;
+		stripe->msg.context = ws281x;
+		longest = max(longest, stripe->xfer.len);
+	}
+
+	reinit_completion(&ws281x->xfer_done);
+	atomic_set(&ws281x->xfer_pending, 1);
+	start = ktime_get();
+
+	while (!ret) {
+		next = NULL;
+		for (i = 0; i < ws281x->num_stripes; i++) {
+			stripe = &ws281x->stripes[i];
+			if (stripe->xfer.len && !stripe->queued &&
+			    (!next || stripe->xfer.len > next->xfer.len))
+				next = stripe;
+		}
+		if (!next)
+			break;
+
+		/* Hold the span back by the time it is shorter */
+		lag = (u64)(longest - next->xfer.len) *
+		      ws281x->info->frame_bits * USEC_PER_SEC;
+		deadline = ktime_add_us(start, div_u64(lag, freq));
+		delay_us = ktime_us_delta(deadline, ktime_get());
+		if (delay_us > 0)
+			fsleep(delay_us);
+
+		next->queued = true;
+		atomic_inc(&ws281x->xfer_pending);
+		ret = spi_async(next->spi, &next->msg);
+		if (ret)
+			atomic_dec(&ws281x->xfer_pending);
+	}
+
+	ws281x_spi_complete(ws281x);
+	wait_for_completion(&ws281x->xfer_done);
+
+	for (i = 0; i < ws281x->num_stripes; i++) {
+		stripe = &ws281x->stripes[i];
+		if (!ret)
+			ret = stripe->msg.status;
+		stripe->queued = false;
+	}
 
 	return ret;
 }
 
 /**
- * ws281x_register_leds() - Register each individual LED
- * @dev: Pointer to parent device.
+ * ws281x_serdev_xfer() - Send the pixelstream via UART
  * @ws281x: Driver data.
+ * @len: Number of bytes of the pixelstream to send.
  *
- * Iterate through each defined LED and register it as a multicolor LED.
+ * Queue the pixelstream to the UART and wait until it has left the
+ * shift register, so that the idle line that follows is what latches
+ * the data.
  *
- * Return: 0 for success or error for failure.
+ * Return: 0 on success or error on failure.
  */
-static int ws281x_register_leds(struct device *dev,
-				struct ws281x_array *ws281x)
+static int ws281x_serdev_xfer(struct ws281x_array *ws281x, size_t len)
 {
-	struct fwnode_handle *parent_node = dev_fwnode(ws281x->dev);
-	struct fwnode_handle *child_node;
-	int ret;
-	int num = 0;
+	struct serdev_device *serdev = ws281x->serdev;
+	ssize_t ret;
 
-	fwnode_for_each_child_node(parent_node, child_node) {
-		struct mc_subled *mc_led_info;
-		struct led_init_data init_data = {};
-
-		mc_led_info = devm_kmalloc_array(dev, ws281x->info->ch_per_led,
-						 sizeof(*mc_led_info),
-						 GFP_KERNEL);
-		init_data.fwnode = child_node;
-
-		mc_led_info[0].color_index = LED_COLOR_ID_RED;
-		mc_led_info[1].color_index = LED_COLOR_ID_GREEN;
-		mc_led_info[2].color_index = LED_COLOR_ID_BLUE;
-
-		ws281x->leds[num].parent = ws281x;
-		ws281x->leds[num].led.subled_info = mc_led_info;
-		ws281x->leds[num].led.num_colors = ws281x->info->ch_per_led;
-		ws281x->leds[num].led.led_cdev.brightness = LED_OFF;
-		ws281x->leds[num].led.led_cdev.max_brightness = LED_FULL;
-		ws281x->leds[num].led.led_cdev.brightness_set_blocking = \
-			ws281x_brightness_set_blocking;
-
-		ret = devm_led_classdev_multicolor_register_ext(ws281x->dev,
-								&ws281x->leds[num].led,
-								&init_data);
-		if (ret)
-			return ret;
-		num++;
-	}
+	ret = serdev_device_write(serdev, ws281x->pixelstream, len,
+				  MAX_SCHEDULE_TIMEOUT);
+	if (ret < 0)
+		return ret;
+
+	serdev_device_wait_until_sent(serdev, 0);
 
 	return 0;
 }
 
-static int ws281x_spi_probe(struct spi_device *spi)
+/**
+ * ws281x_frame_time_us() - Theoretical time to send and latch a frame
+ * @ws281x: Driver data.
+ * @count: Number of LEDs in the frame.
+ *
+ * Return: Time in microseconds.
+ */
+static u32 ws281x_frame_time_us(struct ws281x_array *ws281x, u32 count)
 {
-	struct device *dev = &spi->dev;
-	struct ws281x_array *ws281x;
-	size_t count;
-	int ret;
+	const struct ws281x_chipinfo *info = ws281x->info;
+	u64 frame_bits = (u64)info->pixel_sz * ws281x_wire_leds(ws281x, count) *
+			 info->frame_bits;
 
-	count = device_get_child_node_count(&spi->dev);
-	if (!count)
-		return dev_err_probe(dev, -EINVAL,
-				     "No LEDs defined for control\n");
+	return div_u64(frame_bits * USEC_PER_SEC, info->write_freq) + 50;
+}
 
-	ws281x = devm_kzalloc(&spi->dev,
-			      struct_size(ws281x, leds, count), GFP_KERNEL);
-	if (!ws281x)
-		return -ENOMEM;
+/**
+ * ws281x_check_wire_rate() - Compare a transfer against the bus rate
+ * @ws281x: Driver data.
+ * @len: Number of bytes sent back to back.
+ * @elapsed_ns: Time taken by the transfer.
+ *
+ * Controllers may run slower than requested or stall to refill their
+ * FIFO. Once a transfer takes longer than its theoretical duration plus
+ * the latch time (and some slack for software overhead) the LEDs may
+ * have latched part of the frame, so count the transfer as suspect and
+ * switch to the fallback encoding after too many of them in a row, if
+ * allowed to. The new table is built by fallback_work, outside of the
+ * flush path, and the run of suspect transfers is kept at the threshold
+ * until then so the next suspect transfer tries again if it failed.
+ */
+static void ws281x_check_wire_rate(struct ws281x_array *ws281x, size_t len,
+				   u64 elapsed_ns)
+{
+	const struct ws281x_chipinfo *info = ws281x->info;
+	u64 bits = (u64)len * info->frame_bits;
+	u64 expected_ns = div_u64(bits * NSEC_PER_SEC, info->write_freq);
 
-	ws281x->num_leds = count;
-	ws281x->dev = dev;
-	ws281x->info = device_get_match_data(dev);
-	spi_set_drvdata(spi, ws281x);
+	if (elapsed_ns)
+		ws281x->achieved_bps = div64_u64(bits * NSEC_PER_SEC,
+						 elapsed_ns);
 
-	ret = devm_mutex_init(dev, &ws281x->mutex);
-	if (ret)
-		return dev_err_probe(&spi->dev, ret, "Could not get mutex\n");
+	if (elapsed_ns <= expected_ns + (50 + ws281x->suspect_slack_us) *
+			  NSEC_PER_USEC) {
+		ws281x->suspect_run = 0;
+		return;
+	}
 
-	spi->mode = SPI_MODE_0;
-	spi->bits_per_word = 8;
-	spi->max_speed_hz = ws281x->info->write_freq;
+	ws281x->stat_suspect++;
+	if (++ws281x->suspect_run < WS281X_SUSPECT_RUN ||
+	    !ws281x->auto_fallback || !info->fallback)
+		return;
 
-	ret = spi_setup(spi);
-	if (ret)
-		return dev_err_probe(&spi->dev, ret,
-				     "Unable to set up SPI for ws281x\n");
+	ws281x->suspect_run = WS281X_SUSPECT_RUN;
+	queue_work(system_wq, &ws281x->fallback_work);
+}
 
-	ws281x->pixelstream = devm_kcalloc(&spi->dev,
-					   (ws281x->info->pixel_sz * count),
-					   sizeof(uint8_t), GFP_KERNEL);
-	if (!ws281x->pixelstream)
-		return -ENOMEM;
+static void ws281x_fallback_work(struct work_struct *work)
+{
+	struct ws281x_array *ws281x = container_of(work, struct ws281x_array,
+						   fallback_work);
+	const struct ws281x_chipinfo *info;
 
-	ws281x->spi = spi;
+	mutex_lock(&ws281x->table_lock);
+	info = ws281x->table_info;
 
-	ret = ws281x_register_leds(&spi->dev, ws281x);
-	if (ret)
-		return dev_err_probe(&spi->dev, ret,
-				     "Cannot register LEDs\n");
+	/* Nothing to do if a new table is not in use yet. */
+	if (info != READ_ONCE(ws281x->info) || !info->fallback)
+		goto out;
 
-	return 0;
+	ws281x->table_info = info->fallback;
+	if (ws281x_build_table(ws281x)) {
+		ws281x->table_info = info;
+		goto out;
+	}
+
+	dev_warn(ws281x->dev,
+		 "bus achieves %u bps for %u Hz, falling back to %u Hz\n",
+		 READ_ONCE(ws281x->achieved_bps), info->write_freq,
+		 info->fallback->write_freq);
+out:
+	mutex_unlock(&ws281x->table_lock);
 }
 
-/*
- * The datasheet for the ws2812b defines a 0 as high for 0.4us and low
- * for 0.85us, and a 1 as high for 0.8us and low for 0.4us. By setting
- * our transfer rate to 6.4Mhz (8 times the 800KHz refresh rate) this
- * allows an SPI write of 0xc0 (11000000) to be interpreted as a 0 and
- * 0xfc (11111100) to be interpreted as a 1.
+/**
+ * ws281x_write() - Write the active pixel buffer to the LEDs
+ * @ws281x: Driver data.
+ * @count: Number of LEDs to send, starting from the first one.
+ *
+ * Write the active pixelstream from the driver data to the LEDs via
+ * the SPI bus or UART to update the LEDs. Every LED keeps the data it
+ * received last, so the LEDs after the last changed one do not need to
+ * be sent. In dry run mode only wait for as long as the transfer would
+ * take.
+ *
+ * Return: 0 on success or error on failure.
  */
-static const struct ws281x_chipinfo ws2812b_info = {
-	.zero_val = 0xc0,
-	.one_val = 0xfc,
-	.write_freq = 6400000,
-	.subpixel_sz = BITS_PER_BYTE,
-	.ch_per_led = 3,
-	.pixel_sz = (BITS_PER_BYTE * 3),
-};
+static int ws281x_write(struct ws281x_array *ws281x, u32 count)
+{
+	size_t len = ws281x->info->pixel_sz * count;
+	size_t wire_len = ws281x->info->pixel_sz *
+			  ws281x_wire_leds(ws281x, count);
+	ktime_t start;
+	int ret;
 
-static const struct of_device_id ws281x_spi_dt_ids[] = {
-	{ .compatible = "worldsemi,ws2812b-spi", .data = &ws2812b_info },
-	{},
-};
-MODULE_DEVICE_TABLE(of, ws281x_spi_dt_ids);
+	if (READ_ONCE(ws281x->dry_run)) {
+		fsleep(ws281x_frame_time_us(ws281x, count));
+		return 0;
+	}
 
-static const struct spi_device_id ws281x_spi_ids[] = {
-	{ "ws2812b-spi", 0 },
+	start = ktime_get();
+	ret = ws281x->xfer(ws281x, len);
+	if (ret) {
+		dev_err(ws281x->dev, "transfer error: %d", ret);
+		return ret;
+	}
+
+	ws281x_check_wire_rate(ws281x, wire_len,
+			       ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	/*
+	 * Sleep for at least 50us so the hardware knows this is the
+	 * end of a transfer.
+	 */
+	usleep_range(50, 200);
+
+	return 0;
+}
+
+/**
+ * ws281x_update_pixelstream() - Update the pixelstream data to write
+ * for the LEDs.
+ * @ws281x: Driver data.
+ *
+ * Iterate through every LED whose color changed since the last flush to
+ * write the appropriate values to the pixelstream buffer inside the
+ * driver data. Every LED is encoded again when a new encoding table was
+ * published since the last flush, except for LEDs holding raw wire data
+ * which is only dropped when the wire encoding itself changed.
+ *
+ * Must be called with the mutex held.
+ *
+ * Return: Number of LEDs up to and including the last changed one.
+ */
+static u32 ws281x_update_pixelstream(struct ws281x_array *ws281x)
+{
+	const struct ws281x_enc_table *table;
+	u32 num_leds = ws281x->num_leds;
+	u32 start, end, last;
+
+	rcu_read_lock();
+	table = rcu_dereference(ws281x->table);
+	if (table->gen != ws281x->enc_gen) {
+		if (table->info != ws281x->info)
+			bitmap_zero(ws281x->raw_map, ws281x->num_leds);
+		ws281x->enc_gen = table->gen;
+		WRITE_ONCE(ws281x->info, table->info);
+		bitmap_fill(ws281x->dirty_map, ws281x->num_leds);
+	}
+
+	last = find_last_bit(ws281x->dirty_map, num_leds);
+	last = last < num_leds ? last + 1 : 0;
+
+	/* LEDs holding raw wire data are sent as is. */
+	bitmap_andnot(ws281x->dirty_map, ws281x->dirty_map, ws281x->raw_map,
+		      num_leds);
+	for_each_set_bitrange(start, end, ws281x->dirty_map, num_leds)
+		table->enc->encode(table, ws281x->pixelstream +
+				   (start * ws281x->info->pixel_sz),
+				   ws281x->colors +
+				   (start * ws281x->info->ch_per_led),
+				   end - start);
+	rcu_read_unlock();
+
+	bitmap_zero(ws281x->dirty_map, num_leds);
+
+	return last;
+}
+
+/**
+ * ws281x_trace() - Record an operation in the trace ring
+ * @ws281x: Driver data.
+ * @op: One of enum ws281x_trace_op.
+ * @first: Index of the first LED touched by the operation.
+ * @count: Number of LEDs touched by the operation.
+ * @value: Value of the operation.
+ * @flags: WS281X_TRACE_* flags.
+ *
+ * Once the ring is full the oldest records are overwritten.
+ */
+static void ws281x_trace(struct ws281x_array *ws281x, u16 op, u32 first,
+			 u32 count, u32 value, u16 flags)
+{
+	struct ws281x_trace_rec *rec;
+
+	spin_lock(&ws281x->trace_lock);
+	if (ws281x->trace) {
+		if (ws281x->trace_head - ws281x->trace_tail == WS281X_TRACE_LEN)
+			ws281x->trace_tail++;
+		rec = &ws281x->trace[ws281x->trace_head++ % WS281X_TRACE_LEN];
+		rec->ts_ns = ktime_get_ns();
+		rec->first = first;
+		rec->count = count;
+		rec->op = op;
+		rec->flags = flags;
+		rec->value = value;
+	}
+	spin_unlock(&ws281x->trace_lock);
+}
+
+static void ws281x_complete_latches(struct list_head *latches, int error)
+{
+	struct ws281x_latch *latch, *tmp;
+
+	list_for_each_entry_safe(latch, tmp, latches, node) {
+		list_del(&latch->node);
+		latch->done(latch, error);
+	}
+}
+
+/**
+ * ws281x_flush_work() - Send the latest colors to the LEDs
+ * @work: Pointer to flush_work of the array.
+ *
+ * Format and write the pixelstream if any color (or the encoding table)
+ * changed since the last flush, and account the time it took in the
+ * running frame time and in the statistics of the array.
+ */
+static void ws281x_flush_work(struct work_struct *work)
+{
+	struct ws281x_array *ws281x = container_of(work, struct ws281x_array,
+						   flush_work);
+	LIST_HEAD(latches);
+	ktime_t start, end;
+	u64 latency_us;
+	u32 count;
+	int ret = 0;
+
+	mutex_lock(&ws281x->mutex);
+	if (ws281x->enc_gen != READ_ONCE(ws281x->table_gen) && !ws281x->dirty) {
+		ws281x->first_dirty = ktime_get();
+		ws281x->dirty = true;
+	}
+
+	if (ws281x->dirty) {
+		ws281x->dirty = false;
+		list_splice_init(&ws281x->latches, &latches);
+		count = ws281x_update_pixelstream(ws281x);
+		start = ktime_get();
+		/* Only failed fenced commits may be waiting for the latch */
+		ret = count ? ws281x_write(ws281x, count) : 0;
+		if (ret)
+			ws281x->flush_error = ret;
+		end = ktime_get();
+		ewma_ws281x_us_add(&ws281x->frame_avg,
+				   ktime_us_delta(end, start));
+
+		latency_us = ktime_us_delta(end, ws281x->first_dirty);
+		ws281x->stat_flushes++;
+		ws281x->stat_latency_us += latency_us;
+		ws281x->stat_latency_max_us = max(ws281x->stat_latency_max_us,
+						  latency_us);
+		ws281x_trace(ws281x, WS281X_TRACE_FLUSH, 0, count,
+			     ktime_us_delta(end, start), 0);
+	}
+	mutex_unlock(&ws281x->mutex);
+
+	ws281x_complete_latches(&latches, ret);
+}
+
+static enum hrtimer_restart ws281x_flush_timer(struct hrtimer *timer)
+{
+	struct ws281x_array *ws281x = container_of(timer, struct ws281x_array,
+						   flush_timer);
+
+	queue_work(system_highpri_wq, &ws281x->flush_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * ws281x_mark_dirty() - Mark a range of LEDs to be sent in the next flush
+ * @ws281x: Driver data.
+ * @first: Index of the first changed LED.
+ * @count: Number of changed LEDs.
+ *
+ * The LEDs are encoded from their color again, replacing any raw wire
+ * data they held.
+ *
+ * Must be called with the mutex held.
+ */
+static void ws281x_mark_dirty(struct ws281x_array *ws281x, u32 first,
+			      u32 count)
+{
+	bitmap_set(ws281x->dirty_map, first, count);
+	bitmap_clear(ws281x->raw_map, first, count);
+}
+
+/**
+ * ws281x_schedule_flush() - Schedule a flush after a color change
+ * @ws281x: Driver data.
+ * @now: Time at which the colors were changed.
+ * @urgent: True when the change must be sent as soon as possible.
+ *
+ * A change arriving while the array is idle is flushed immediately.
+ * While changes arrive faster than a frame can be sent, the flush is
+ * delayed by the time by which they outpace the bus (at most one frame
+ * time) so that a burst of changes goes out in as few frames as
+ * possible. Changes arriving while a flush is already scheduled are
+ * picked up by that flush. An urgent change cuts any pending coalescing
+ * window short so that it goes out, together with everything changed
+ * before it, in the next frame the bus can send.
+ *
+ * Must be called with the mutex held.
+ */
+static void ws281x_schedule_flush(struct ws281x_array *ws281x, ktime_t now,
+				  bool urgent)
+{
+	unsigned long frame_us = ewma_ws281x_us_read(&ws281x->frame_avg);
+	s64 interval_us = ktime_us_delta(now, ws281x->last_arrival);
+	unsigned long avg_us;
+
+	ws281x->last_arrival = now;
+	ws281x->stat_ops++;
+	if (!ws281x->dirty)
+		ws281x->first_dirty = now;
+	ws281x->dirty = true;
+
+	/* Cap idle gaps so the average recovers quickly from a burst. */
+	ewma_ws281x_us_add(&ws281x->arrival_avg,
+			   clamp_t(s64, interval_us, 0, 2 * frame_us));
+	avg_us = ewma_ws281x_us_read(&ws281x->arrival_avg);
+
+	if (interval_us < frame_us && avg_us < frame_us)
+		ws281x->window_us = frame_us - avg_us;
+	else
+		ws281x->window_us = 0;
+
+	if (urgent) {
+		hrtimer_try_to_cancel(&ws281x->flush_timer);
+		queue_work(system_highpri_wq, &ws281x->flush_work);
+		return;
+	}
+
+	if (hrtimer_active(&ws281x->flush_timer) ||
+	    work_pending(&ws281x->flush_work))
+		return;
+
+	if (!ws281x->window_us)
+		queue_work(system_highpri_wq, &ws281x->flush_work);
+	else
+		hrtimer_start(&ws281x->flush_timer,
+			      us_to_ktime(ws281x->window_us),
+			      HRTIMER_MODE_REL);
+}
+
+/**
+ * ws281x_brightness_set_blocking() - Update the subpixel data for an
+ * LED
+ * @dev: Pointer to led_classdev of LED being updated.
+ * @brightness: Brightness value to write to LED.
+ *
+ * Convert the brightness information into the individual color
+ * components for the updated LED and store them for every LED of the
+ * segment it controls. Then, schedule a flush of the pixelstream to
+ * update the individual pixels that have changed.
+ *
+ * The flush happens later, so its result can not be returned. Instead
+ * the error of a failed flush is returned (once) by the next call, so
+ * that brightness writes stop reporting success on a dead bus.
+ *
+ * Return: 0 for success or the error of the last failed flush.
+ */
+static int ws281x_brightness_set_blocking(struct led_classdev *dev, enum led_brightness brightness)
+{
+	struct led_classdev_mc *mc_cdev = lcdev_to_mccdev(dev);
+	struct ws281x_led *ws281x_led = container_of(mc_cdev, struct ws281x_led, led);
+	struct ws281x_array *ws281x = ws281x_led->parent;
+	u8 ch = ws281x->info->ch_per_led;
+	bool urgent = READ_ONCE(ws281x_led->priority);
+	ktime_t now = ktime_get();
+	u8 *color;
+	int i, j, ret;
+
+	led_mc_calc_color_components(mc_cdev, brightness);
+	mutex_lock(&ws281x->mutex);
+	color = ws281x->colors + (ws281x_led->first * ch);
+	for (i = 0; i < ws281x_led->count; i++, color += ch)
+		for (j = 0; j < ch; j++)
+			color[j] = mc_cdev->subled_info[j].brightness;
+	ws281x_mark_dirty(ws281x, ws281x_led->first, ws281x_led->count);
+	ws281x_trace(ws281x, WS281X_TRACE_BRIGHTNESS, ws281x_led->first,
+		     ws281x_led->count, brightness,
+		     urgent ? WS281X_TRACE_URGENT : 0);
+	ws281x_schedule_flush(ws281x, now, urgent);
+	ret = ws281x->flush_error;
+	ws281x->flush_error = 0;
+	mutex_unlock(&ws281x->mutex);
+
+	return ret;
+}
+
+/**
+ * __ws281x_part_commit() - Commit part of a frame to the array
+ * @part: Character device data.
+ * @first: Index of the first LED of the frame to commit.
+ * @count: Number of LEDs to commit.
+ * @latch: Optional completion of the commit once the LEDs latched it.
+ * @now: Time at which the commit was requested.
+ *
+ * Copy the colors of the range from the frame buffer to the array and
+ * schedule a flush.
+ *
+ * Must be called with the mutex held.
+ */
+static void __ws281x_part_commit(struct ws281x_part *part, u32 first,
+				 u32 count, struct ws281x_latch *latch,
+				 ktime_t now)
+{
+	struct ws281x_array *ws281x = part->parent;
+	u8 ch = ws281x->info->ch_per_led;
+
+	memcpy(ws281x->colors + ((part->first + first) * ch),
+	       part->colors + (first * ch), count * ch);
+	ws281x_mark_dirty(ws281x, part->first + first, count);
+	ws281x_trace(ws281x, WS281X_TRACE_BULK, part->first + first, count,
+		     0, 0);
+	if (latch)
+		list_add_tail(&latch->node, &ws281x->latches);
+	ws281x_schedule_flush(ws281x, now, false);
+}
+
+static void ws281x_part_commit(struct ws281x_part *part, u32 first,
+			       u32 count, struct ws281x_latch *latch)
+{
+	ktime_t now = ktime_get();
+
+	mutex_lock(&part->parent->mutex);
+	__ws281x_part_commit(part, first, count, latch, now);
+	mutex_unlock(&part->parent->mutex);
+}
+
+/**
+ * ws281x_part_pixel() - Locate a pixel of the frame used as a matrix
+ * @part: Character device data.
+ * @x: Column of the pixel.
+ * @y: Row of the pixel.
+ *
+ * Return: Index of the pixel in the frame.
+ */
+static u32 ws281x_part_pixel(struct ws281x_part *part, u32 x, u32 y)
+{
+	/* Rows run backwards by their parity in the whole array */
+	if (part->serpentine && (((part->first / part->width) + y) & 1))
+		x = part->width - 1 - x;
+
+	return (y * part->width) + x;
+}
+
+/**
+ * __ws281x_part_commit_rect() - Commit a rectangle of the matrix
+ * @part: Character device data.
+ * @rect: Rectangle of the matrix to commit.
+ * @latch: Optional completion of the commit once the LEDs latched it.
+ * @now: Time at which the commit was requested.
+ *
+ * Each row of the rectangle is a contiguous range of LEDs (running
+ * backwards on odd rows of a serpentine array), so only those ranges
+ * are copied to the array and marked for the next flush.
+ *
+ * Must be called with the mutex held.
+ */
+static void __ws281x_part_commit_rect(struct ws281x_part *part,
+				      const struct ws281x_rect *rect,
+				      struct ws281x_latch *latch, ktime_t now)
+{
+	struct ws281x_array *ws281x = part->parent;
+	u8 ch = ws281x->info->ch_per_led;
+	u32 first, lowest = U32_MAX, y;
+
+	for (y = rect->y; y < rect->y + rect->h; y++) {
+		first = min(ws281x_part_pixel(part, rect->x, y),
+			    ws281x_part_pixel(part, rect->x + rect->w - 1, y));
+		memcpy(ws281x->colors + ((part->first + first) * ch),
+		       part->colors + (first * ch), rect->w * ch);
+		ws281x_mark_dirty(ws281x, part->first + first, rect->w);
+		lowest = min(lowest, first);
+	}
+	ws281x_trace(ws281x, WS281X_TRACE_SPARSE, part->first + lowest,
+		     rect->w * rect->h, rect->w, 0);
+	if (latch)
+		list_add_tail(&latch->node, &ws281x->latches);
+	ws281x_schedule_flush(ws281x, now, false);
+}
+
+static void ws281x_part_commit_rect(struct ws281x_part *part,
+				    const struct ws281x_rect *rect)
+{
+	ktime_t now = ktime_get();
+
+	mutex_lock(&part->parent->mutex);
+	__ws281x_part_commit_rect(part, rect, NULL, now);
+	mutex_unlock(&part->parent->mutex);
+}
+
+static bool ws281x_part_rect_valid(struct ws281x_part *part,
+				   const struct ws281x_rect *rect)
+{
+	return rect->w && rect->h &&
+	       rect->w <= part->width && rect->x <= part->width - rect->w &&
+	       rect->h <= part->height && rect->y <= part->height - rect->h;
+}
+
+static void ws281x_part_fill(struct ws281x_part *part,
+			     const struct ws281x_blit_fill *fill)
+{
+	u8 ch = part->parent->info->ch_per_led;
+	const struct ws281x_rect *r = &fill->rect;
+	u32 x, y;
+
+	for (y = r->y; y < r->y + r->h; y++)
+		for (x = r->x; x < r->x + r->w; x++)
+			memcpy(part->colors + (ws281x_part_pixel(part, x, y) * ch),
+			       fill->color, ch);
+}
+
+static int ws281x_part_copy(struct ws281x_part *part,
+			    const struct ws281x_blit_copy *copy)
+{
+	u8 ch = part->parent->info->ch_per_led;
+	const struct ws281x_rect *r = &copy->src;
+	u8 *tmp, *pixel;
+	u32 x, y;
+
+	/* Go through a copy, the rectangles may overlap. */
+	tmp = kvmalloc_array(r->w * r->h, ch, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	pixel = tmp;
+	for (y = r->y; y < r->y + r->h; y++)
+		for (x = r->x; x < r->x + r->w; x++, pixel += ch)
+			memcpy(pixel,
+			       part->colors + (ws281x_part_pixel(part, x, y) * ch),
+			       ch);
+
+	pixel = tmp;
+	for (y = 0; y < r->h; y++)
+		for (x = 0; x < r->w; x++, pixel += ch)
+			memcpy(part->colors +
+			       (ws281x_part_pixel(part, copy->dst_x + x,
+						  copy->dst_y + y) * ch),
+			       pixel, ch);
+
+	kvfree(tmp);
+
+	return 0;
+}
+
+static int ws281x_part_sprite(struct ws281x_part *part,
+			      const struct ws281x_blit_sprite *sprite)
+{
+	u8 ch = part->parent->info->ch_per_led;
+	const struct ws281x_rect *r = &sprite->rect;
+	bool keyed = sprite->flags & WS281X_SPRITE_KEY;
+	u8 *data, *pixel;
+	u32 x, y;
+
+	data = vmemdup_user(u64_to_user_ptr(sprite->data),
+			    (size_t)r->w * r->h * ch);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	pixel = data;
+	for (y = r->y; y < r->y + r->h; y++) {
+		for (x = r->x; x < r->x + r->w; x++, pixel += ch) {
+			if (keyed && !memcmp(pixel, sprite->key, ch))
+				continue;
+			memcpy(part->colors + (ws281x_part_pixel(part, x, y) * ch),
+			       pixel, ch);
+		}
+	}
+
+	kvfree(data);
+
+	return 0;
+}
+
+static void ws281x_part_gradient(struct ws281x_part *part,
+				 const struct ws281x_blit_gradient *grad)
+{
+	u8 ch = part->parent->info->ch_per_led;
+	const struct ws281x_rect *r = &grad->rect;
+	bool vertical = grad->flags & WS281X_GRADIENT_VERTICAL;
+	u32 steps = (vertical ? r->h : r->w) - 1;
+	u8 *pixel;
+	u32 x, y, pos;
+	int i;
+
+	for (y = 0; y < r->h; y++) {
+		for (x = 0; x < r->w; x++) {
+			pos = vertical ? y : x;
+			pixel = part->colors +
+				(ws281x_part_pixel(part, r->x + x, r->y + y) * ch);
+			for (i = 0; i < ch; i++)
+				pixel[i] = steps ? grad->from[i] +
+					   ((int)grad->to[i] - grad->from[i]) *
+					   (int)pos / (int)steps :
+					   grad->from[i];
+		}
+	}
+}
+
+/**
+ * ws281x_part_blit() - Run a blitter operation on the matrix
+ * @part: Character device data.
+ * @cmd: Blitter ioctl.
+ * @argp: Blitter ioctl argument.
+ *
+ * Draw into the frame buffer and commit only the rectangle that was
+ * drawn to, as a single flush.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_part_blit(struct ws281x_part *part, unsigned int cmd,
+			    void __user *argp)
+{
+	union {
+		struct ws281x_blit_fill fill;
+		struct ws281x_blit_copy copy;
+		struct ws281x_blit_sprite sprite;
+		struct ws281x_blit_gradient gradient;
+	} arg;
+	struct ws281x_rect dst;
+	int ret = 0;
+
+	if (copy_from_user(&arg, argp, _IOC_SIZE(cmd)))
+		return -EFAULT;
+
+	switch (cmd) {
+	case WS281X_IOC_FILL:
+		dst = arg.fill.rect;
+		break;
+	case WS281X_IOC_COPY:
+		if (!ws281x_part_rect_valid(part, &arg.copy.src))
+			return -EINVAL;
+		dst = arg.copy.src;
+		dst.x = arg.copy.dst_x;
+		dst.y = arg.copy.dst_y;
+		break;
+	case WS281X_IOC_SPRITE:
+		dst = arg.sprite.rect;
+		break;
+	case WS281X_IOC_GRADIENT:
+		dst = arg.gradient.rect;
+		break;
+	default:
+		return -ENOTTY;
+	}
+
+	if (!ws281x_part_rect_valid(part, &dst))
+		return -EINVAL;
+
+	switch (cmd) {
+	case WS281X_IOC_FILL:
+		ws281x_part_fill(part, &arg.fill);
+		break;
+	case WS281X_IOC_COPY:
+		ret = ws281x_part_copy(part, &arg.copy);
+		break;
+	case WS281X_IOC_SPRITE:
+		ret = ws281x_part_sprite(part, &arg.sprite);
+		break;
+	case WS281X_IOC_GRADIENT:
+		ws281x_part_gradient(part, &arg.gradient);
+		break;
+	}
+
+	if (ret)
+		return ret;
+
+	ws281x_part_commit_rect(part, &dst);
+
+	return 0;
+}
+
+static struct ws281x_part *ws281x_file_part(struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+
+	return container_of(misc, struct ws281x_part, misc);
+}
+
+/*
+ * Keep the array from being unbound while a file operation uses the
+ * frame. Open files outlive the array, after which their operations fail
+ * with -ENODEV.
+ */
+static int ws281x_part_enter(struct ws281x_part *part)
+{
+	down_read(&part->lock);
+	if (part->gone) {
+		up_read(&part->lock);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+/* Same as ws281x_part_enter(), but fails with -EAGAIN instead of waiting. */
+static int ws281x_part_try_enter(struct ws281x_part *part)
+{
+	if (!down_read_trylock(&part->lock))
+		return -EAGAIN;
+
+	if (part->gone) {
+		up_read(&part->lock);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static void ws281x_part_exit(struct ws281x_part *part)
+{
+	up_read(&part->lock);
+}
+
+static void ws281x_free_part(struct kref *ref)
+{
+	struct ws281x_part *part = container_of(ref, struct ws281x_part, ref);
+
+	vfree(part->colors);
+	vfree(part->raw);
+	kfree(part);
+}
+
+static int ws281x_part_open(struct inode *inode, struct file *file)
+{
+	kref_get(&ws281x_file_part(file)->ref);
+
+	return 0;
+}
+
+static int ws281x_part_release(struct inode *inode, struct file *file)
+{
+	kref_put(&ws281x_file_part(file)->ref, ws281x_free_part);
+
+	return 0;
+}
+
+static loff_t ws281x_part_llseek(struct file *file, loff_t offset,
+				 int whence)
+{
+	struct ws281x_part *part = ws281x_file_part(file);
+	loff_t ret;
+
+	ret = ws281x_part_enter(part);
+	if (ret)
+		return ret;
+
+	ret = fixed_size_llseek(file, offset, whence,
+				part->count * part->parent->info->ch_per_led);
+	ws281x_part_exit(part);
+
+	return ret;
+}
+
+/*
+ * Writing to the character device updates the frame buffer at the file
+ * position and commits every LED touched by the write.
+ */
+static ssize_t ws281x_part_write(struct file *file, const char __user *buf,
+				 size_t len, loff_t *ppos)
+{
+	struct ws281x_part *part = ws281x_file_part(file);
+	loff_t pos = *ppos;
+	u32 first, last;
+	ssize_t ret;
+	size_t size;
+	u8 ch;
+
+	ret = ws281x_part_enter(part);
+	if (ret)
+		return ret;
+
+	ch = part->parent->info->ch_per_led;
+	size = part->count * ch;
+	if (pos < 0 || pos >= size) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	len = min_t(size_t, len, size - pos);
+	if (copy_from_user(part->colors + pos, buf, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	first = pos / ch;
+	last = DIV_ROUND_UP(pos + len, ch);
+	ws281x_part_commit(part, first, last - first, NULL);
+
+	*ppos = pos + len;
+	ret = len;
+out:
+	ws281x_part_exit(part);
+
+	return ret;
+}
+
+static int ws281x_part_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ws281x_part *part = ws281x_file_part(file);
+	unsigned long raw_pgoff = WS281X_RAW_OFFSET >> PAGE_SHIFT;
+	int ret;
+
+	ret = ws281x_part_enter(part);
+	if (ret)
+		return ret;
+
+	if (vma->vm_pgoff >= raw_pgoff)
+		ret = remap_vmalloc_range(vma, part->raw,
+					  vma->vm_pgoff - raw_pgoff);
+	else
+		ret = remap_vmalloc_range(vma, part->colors, vma->vm_pgoff);
+	ws281x_part_exit(part);
+
+	return ret;
+}
+
+/**
+ * ws281x_part_raw() - Commit raw wire data to a range of the frame
+ * @part: Frame the data is committed to.
+ * @argp: Pointer to the struct ws281x_raw from userspace.
+ *
+ * Copy the wire data into the pixelstream of the array, where it is sent
+ * as is instead of the encoded colors of those LEDs. The copy in the
+ * pixelstream is checked to only hold symbols of the current encoding,
+ * so that data changed by userspace while it is being committed from
+ * the mapped staging buffer can not slip through.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_part_raw(struct ws281x_part *part, void __user *argp)
+{
+	struct ws281x_array *ws281x = part->parent;
+	const struct ws281x_enc_table *table;
+	ktime_t now = ktime_get();
+	struct ws281x_raw raw;
+	u8 pixel_sz, *dst;
+	size_t len, i;
+	int ret = 0;
+
+	if (copy_from_user(&raw, argp, sizeof(raw)))
+		return -EFAULT;
+
+	if ((raw.flags & ~WS281X_RAW_MAPPED) || raw.pad ||
+	    raw.first >= part->count || raw.count > part->count - raw.first)
+		return -EINVAL;
+
+	pixel_sz = READ_ONCE(ws281x->info)->pixel_sz;
+	len = raw.count * pixel_sz;
+	if (!(raw.flags & WS281X_RAW_MAPPED) &&
+	    copy_from_user(part->raw + (raw.first * pixel_sz),
+			   u64_to_user_ptr(raw.data), len))
+		return -EFAULT;
+
+	mutex_lock(&ws281x->mutex);
+	rcu_read_lock();
+	table = rcu_dereference(ws281x->table);
+	if (table->info != ws281x->info || pixel_sz != table->info->pixel_sz) {
+		/* The data was encoded for a previous wire encoding. */
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	dst = ws281x->pixelstream + ((part->first + raw.first) * pixel_sz);
+	memcpy(dst, part->raw + (raw.first * pixel_sz), len);
+	for (i = 0; i < len; i++) {
+		if (!test_bit(dst[i], table->legal)) {
+			/* Encode the colors of the LEDs back over it. */
+			ws281x_mark_dirty(ws281x, part->first + raw.first,
+					  raw.count);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	bitmap_set(ws281x->dirty_map, part->first + raw.first, raw.count);
+	bitmap_set(ws281x->raw_map, part->first + raw.first, raw.count);
+	ws281x_trace(ws281x, WS281X_TRACE_RAW, part->first + raw.first,
+		     raw.count, 0, 0);
+	ws281x_schedule_flush(ws281x, now, false);
+out:
+	rcu_read_unlock();
+	mutex_unlock(&ws281x->mutex);
+
+	return ret;
+}
+
+#if IS_ENABLED(CONFIG_SYNC_FILE)
+static const char *ws281x_fence_driver_name(struct dma_fence *fence)
+{
+	return KBUILD_MODNAME;
+}
+
+static const char *ws281x_fence_timeline_name(struct dma_fence *fence)
+{
+	return "latch";
+}
+
+static void ws281x_free_timeline(struct kref *ref)
+{
+	kfree(container_of(ref, struct ws281x_timeline, ref));
+}
+
+/*
+ * Fences keep a reference on the module, since their ops are called for
+ * as long as userspace holds them, and drop it last.
+ */
+static void ws281x_fence_release(struct dma_fence *fence)
+{
+	struct ws281x_fence *f = container_of(fence, struct ws281x_fence,
+					      base);
+
+	kref_put(&f->timeline->ref, ws281x_free_timeline);
+	dma_fence_free(fence);
+	module_put(THIS_MODULE);
+}
+
+static const struct dma_fence_ops ws281x_fence_ops = {
+	.get_driver_name	= ws281x_fence_driver_name,
+	.get_timeline_name	= ws281x_fence_timeline_name,
+	.release		= ws281x_fence_release,
+};
+
+/**
+ * ws281x_signal_fence() - Signal and release an out-fence
+ * @fence: Fence to signal, may be NULL.
+ * @error: Error to signal the fence with, 0 on success.
+ */
+static void ws281x_signal_fence(struct ws281x_fence *fence, int error)
+{
+	if (!fence)
+		return;
+
+	if (error)
+		dma_fence_set_error(&fence->base, error);
+	dma_fence_signal(&fence->base);
+	dma_fence_put(&fence->base);
+}
+
+static void ws281x_fence_latched(struct ws281x_latch *latch, int error)
+{
+	ws281x_signal_fence(container_of(latch, struct ws281x_fence, latch),
+			    error);
+}
+
+static void ws281x_fence_cb(struct dma_fence *fence, struct dma_fence_cb *cb)
+{
+	struct ws281x_fence_wait *wait = container_of(cb,
+						      struct ws281x_fence_wait,
+						      cb);
+	struct ws281x_part *part = wait->part;
+	unsigned long flags;
+
+	spin_lock_irqsave(&part->fence_lock, flags);
+	wait->ready = true;
+	spin_unlock_irqrestore(&part->fence_lock, flags);
+
+	queue_work(system_highpri_wq, &part->fence_work);
+}
+
+static void ws281x_free_fence_wait(struct ws281x_fence_wait *wait, int error)
+{
+	ws281x_signal_fence(wait->out, error);
+	dma_fence_put(wait->in);
+	kfree(wait);
+}
+
+/*
+ * Commit the frame for the fenced commits in the order they were
+ * submitted, as long as their in-fence signaled, so that their out-fences
+ * signal in the order of their seqnos. A commit whose in-fence failed
+ * commits nothing, but its out-fence still waits for the commits queued
+ * before it to be latched.
+ */
+static void ws281x_part_fence_work(struct work_struct *work)
+{
+	struct ws281x_part *part = container_of(work, struct ws281x_part,
+						fence_work);
+	struct ws281x_fence_wait *wait;
+	int gone, status;
+
+	gone = ws281x_part_enter(part);
+	for (;;) {
+		spin_lock_irq(&part->fence_lock);
+		wait = list_first_entry_or_null(&part->fence_waits,
+						struct ws281x_fence_wait, node);
+		if (wait && wait->ready)
+			list_del(&wait->node);
+		else
+			wait = NULL;
+		spin_unlock_irq(&part->fence_lock);
+		if (!wait)
+			break;
+
+		status = wait->in ? dma_fence_get_status(wait->in) : 1;
+		if (gone || (status < 0 && !wait->out)) {
+			ws281x_free_fence_wait(wait, gone ?: status);
+			continue;
+		}
+
+		if (status < 0)
+			dma_fence_set_error(&wait->out->base, status);
+		ws281x_part_commit(part, 0, status < 0 ? 0 : part->count,
+				   wait->out ? &wait->out->latch : NULL);
+		wait->out = NULL;
+		ws281x_free_fence_wait(wait, 0);
+	}
+
+	if (!gone)
+		ws281x_part_exit(part);
+}
+
+/**
+ * ws281x_part_commit_fence() - Commit a frame with sync_file fences
+ * @part: Frame to commit.
+ * @argp: Pointer to the struct ws281x_commit from userspace.
+ *
+ * Commit the whole frame once the optional in-fence signals, without
+ * blocking the caller, and return an optional out-fence that signals
+ * once the LEDs latched the flush carrying the commit. Fenced commits of
+ * a frame are committed in the order they were submitted, so their
+ * out-fences signal in order on the timeline of the frame.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_part_commit_fence(struct ws281x_part *part,
+				    void __user *argp)
+{
+	struct ws281x_timeline *timeline = part->timeline;
+	struct sync_file *sync_file = NULL;
+	struct ws281x_fence_wait *wait;
+	struct ws281x_fence *out = NULL;
+	struct ws281x_commit commit;
+	struct dma_fence *in;
+	int fd = -1, ret;
+
+	if (copy_from_user(&commit, argp, sizeof(commit)))
+		return -EFAULT;
+
+	if ((commit.flags & ~(WS281X_COMMIT_IN_FENCE |
+			      WS281X_COMMIT_OUT_FENCE)) || commit.pad)
+		return -EINVAL;
+
+	wait = kzalloc(sizeof(*wait), GFP_KERNEL);
+	if (!wait)
+		return -ENOMEM;
+
+	wait->part = part;
+	wait->ready = true;
+	if (commit.flags & WS281X_COMMIT_IN_FENCE) {
+		wait->in = sync_file_get_fence(commit.in_fence);
+		if (!wait->in) {
+			kfree(wait);
+			return -EINVAL;
+		}
+		wait->ready = false;
+	}
+
+	if (commit.flags & WS281X_COMMIT_OUT_FENCE) {
+		out = kzalloc(sizeof(*out), GFP_KERNEL);
+		if (!out) {
+			ret = -ENOMEM;
+			goto err_wait;
+		}
+
+		fd = get_unused_fd_flags(O_CLOEXEC);
+		if (fd < 0) {
+			kfree(out);
+			ret = fd;
+			goto err_wait;
+		}
+
+		__module_get(THIS_MODULE);
+		kref_get(&timeline->ref);
+		out->timeline = timeline;
+		out->latch.done = ws281x_fence_latched;
+	}
+
+	/*
+	 * The seqno is only taken once nothing can fail anymore, so seqnos
+	 * are handed out in the order the commits are queued.
+	 */
+	mutex_lock(&part->fence_mutex);
+	if (out) {
+		dma_fence_init(&out->base, &ws281x_fence_ops, &timeline->lock,
+			       timeline->context, timeline->seqno + 1);
+
+		sync_file = sync_file_create(&out->base);
+		commit.out_fence = fd;
+		if (!sync_file ||
+		    copy_to_user(argp, &commit, sizeof(commit))) {
+			mutex_unlock(&part->fence_mutex);
+			ret = sync_file ? -EFAULT : -ENOMEM;
+			if (sync_file)
+				fput(sync_file->file);
+			put_unused_fd(fd);
+			wait->out = out;
+			goto err_wait;
+		}
+
+		timeline->seqno++;
+		wait->out = out;
+	}
+
+	/* Once queued, a ready commit may be freed by the work at any time. */
+	in = wait->in;
+	spin_lock_irq(&part->fence_lock);
+	list_add_tail(&wait->node, &part->fence_waits);
+	spin_unlock_irq(&part->fence_lock);
+	mutex_unlock(&part->fence_mutex);
+
+	if (sync_file)
+		fd_install(fd, sync_file->file);
+
+	/* Commit right away when the fence already signaled. */
+	if (!in)
+		queue_work(system_highpri_wq, &part->fence_work);
+	else if (dma_fence_add_callback(in, &wait->cb, ws281x_fence_cb))
+		ws281x_fence_cb(in, &wait->cb);
+
+	return 0;
+
+err_wait:
+	ws281x_free_fence_wait(wait, ret);
+
+	return ret;
+}
+
+static int ws281x_init_fences(struct ws281x_part *part)
+{
+	part->timeline = kzalloc(sizeof(*part->timeline), GFP_KERNEL);
+	if (!part->timeline)
+		return -ENOMEM;
+
+	kref_init(&part->timeline->ref);
+	spin_lock_init(&part->timeline->lock);
+	part->timeline->context = dma_fence_context_alloc(1);
+	mutex_init(&part->fence_mutex);
+	spin_lock_init(&part->fence_lock);
+	INIT_LIST_HEAD(&part->fence_waits);
+	INIT_WORK(&part->fence_work, ws281x_part_fence_work);
+
+	return 0;
+}
+
+/*
+ * Drop the commits still waiting, failing their out-fences, so that no
+ * callback can run once the frame is gone, and release the timeline to
+ * the fences still held by userspace.
+ */
+static void ws281x_exit_fences(struct ws281x_part *part)
+{
+	struct ws281x_fence_wait *wait, *tmp;
+	LIST_HEAD(waits);
+
+	spin_lock_irq(&part->fence_lock);
+	list_splice_init(&part->fence_waits, &waits);
+	spin_unlock_irq(&part->fence_lock);
+
+	/* A callback that already ran has returned once this is done. */
+	list_for_each_entry(wait, &waits, node)
+		if (wait->in)
+			dma_fence_remove_callback(wait->in, &wait->cb);
+
+	cancel_work_sync(&part->fence_work);
+	list_for_each_entry_safe(wait, tmp, &waits, node)
+		ws281x_free_fence_wait(wait, -ENODEV);
+
+	kref_put(&part->timeline->ref, ws281x_free_timeline);
+}
+#else
+static int ws281x_part_commit_fence(struct ws281x_part *part,
+				    void __user *argp)
+{
+	return -EOPNOTSUPP;
+}
+
+static int ws281x_init_fences(struct ws281x_part *part)
+{
+	return 0;
+}
+
+static void ws281x_exit_fences(struct ws281x_part *part)
+{
+}
+#endif
+
+static long ws281x_part_do_ioctl(struct ws281x_part *part, unsigned int cmd,
+				 unsigned long arg)
+{
+	struct ws281x_ioc_raw_info raw_info = {};
+	const struct ws281x_chipinfo *enc;
+	struct ws281x_ioc_info info = {};
+	int i;
+
+	switch (cmd) {
+	case WS281X_IOC_INFO:
+		info.num_leds = part->count;
+		info.ch_per_led = part->parent->info->ch_per_led;
+		info.width = part->width;
+		info.height = part->height;
+		if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+			return -EFAULT;
+		return 0;
+	case WS281X_IOC_COMMIT:
+		ws281x_part_commit(part, 0, part->count, NULL);
+		return 0;
+	case WS281X_IOC_FILL:
+	case WS281X_IOC_COPY:
+	case WS281X_IOC_SPRITE:
+	case WS281X_IOC_GRADIENT:
+		return ws281x_part_blit(part, cmd, (void __user *)arg);
+	case WS281X_IOC_RAW_INFO:
+		rcu_read_lock();
+		enc = rcu_dereference(part->parent->table)->info;
+		rcu_read_unlock();
+
+		raw_info.pixel_sz = enc->pixel_sz;
+		raw_info.bits_per_sym = enc->bits_per_sym;
+		for (i = 0; i < BIT(enc->bits_per_sym); i++)
+			raw_info.syms[i] = enc->sym_lut[i];
+		if (copy_to_user((void __user *)arg, &raw_info,
+				 sizeof(raw_info)))
+			return -EFAULT;
+		return 0;
+	case WS281X_IOC_RAW:
+		return ws281x_part_raw(part, (void __user *)arg);
+	case WS281X_IOC_COMMIT_FENCE:
+		return ws281x_part_commit_fence(part, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static long ws281x_part_ioctl(struct file *file, unsigned int cmd,
+			      unsigned long arg)
+{
+	struct ws281x_part *part = ws281x_file_part(file);
+	long ret;
+
+	ret = ws281x_part_enter(part);
+	if (ret)
+		return ret;
+
+	ret = ws281x_part_do_ioctl(part, cmd, arg);
+	ws281x_part_exit(part);
+
+	return ret;
+}
+
+static void ws281x_uring_done(struct io_uring_cmd *ioucmd,
+			      unsigned int issue_flags)
+{
+	struct ws281x_uring_pdu *pdu = io_uring_cmd_to_pdu(ioucmd,
+							   struct ws281x_uring_pdu);
+
+	io_uring_cmd_done(ioucmd, pdu->error, 0, issue_flags);
+}
+
+static void ws281x_uring_latched(struct ws281x_latch *latch, int error)
+{
+	struct ws281x_uring_pdu *pdu = container_of(latch,
+						    struct ws281x_uring_pdu,
+						    latch);
+
+	pdu->error = error;
+	io_uring_cmd_complete_in_task(container_of((void *)pdu,
+						   struct io_uring_cmd, pdu),
+				      ws281x_uring_done);
+}
+
+/**
+ * ws281x_part_do_uring_cmd() - Commit a frame through io_uring
+ * @part: Frame to commit.
+ * @ioucmd: io_uring command, its argument is in the command area of the
+ * SQE.
+ * @issue_flags: IO_URING_F_* flags.
+ *
+ * Commit a range or a rectangle of the frame, and post the completion
+ * of the command once the LEDs latched the flush carrying it. This lets
+ * a single io_uring_enter() submit frames to several arrays. When the
+ * array is busy sending a frame and the command may not block, it is
+ * left to io_uring to retry from a worker.
+ *
+ * Return: -EIOCBQUEUED once queued, or error for failure.
+ */
+static int ws281x_part_do_uring_cmd(struct ws281x_part *part,
+				    struct io_uring_cmd *ioucmd,
+				    unsigned int issue_flags)
+{
+	struct ws281x_uring_pdu *pdu = io_uring_cmd_to_pdu(ioucmd,
+							   struct ws281x_uring_pdu);
+	struct ws281x_array *ws281x = part->parent;
+	ktime_t now = ktime_get();
+	struct ws281x_range range;
+	struct ws281x_rect rect;
+
+	switch (ioucmd->cmd_op) {
+	case WS281X_URING_COMMIT:
+		memcpy(&range, io_uring_sqe_cmd(ioucmd->sqe), sizeof(range));
+		if (range.first >= part->count ||
+		    range.count > part->count - range.first)
+			return -EINVAL;
+		break;
+	case WS281X_URING_SPARSE:
+		memcpy(&rect, io_uring_sqe_cmd(ioucmd->sqe), sizeof(rect));
+		if (!ws281x_part_rect_valid(part, &rect))
+			return -EINVAL;
+		break;
+	default:
+		return -ENOTTY;
+	}
+
+	if (issue_flags & IO_URING_F_NONBLOCK) {
+		if (!mutex_trylock(&ws281x->mutex))
+			return -EAGAIN;
+	} else {
+		mutex_lock(&ws281x->mutex);
+	}
+
+	pdu->latch.done = ws281x_uring_latched;
+	if (ioucmd->cmd_op == WS281X_URING_COMMIT)
+		__ws281x_part_commit(part, range.first, range.count,
+				     &pdu->latch, now);
+	else
+		__ws281x_part_commit_rect(part, &rect, &pdu->latch, now);
+	mutex_unlock(&ws281x->mutex);
+
+	return -EIOCBQUEUED;
+}
+
+static int ws281x_part_uring_cmd(struct io_uring_cmd *ioucmd,
+				 unsigned int issue_flags)
+{
+	struct ws281x_part *part = ws281x_file_part(ioucmd->file);
+	int ret;
+
+	if (issue_flags & IO_URING_F_NONBLOCK)
+		ret = ws281x_part_try_enter(part);
+	else
+		ret = ws281x_part_enter(part);
+	if (ret)
+		return ret;
+
+	ret = ws281x_part_do_uring_cmd(part, ioucmd, issue_flags);
+	ws281x_part_exit(part);
+
+	return ret;
+}
+
+static const struct file_operations ws281x_part_fops = {
+	.owner			= THIS_MODULE,
+	.open			= ws281x_part_open,
+	.release		= ws281x_part_release,
+	.llseek			= ws281x_part_llseek,
+	.write			= ws281x_part_write,
+	.mmap			= ws281x_part_mmap,
+	.unlocked_ioctl		= ws281x_part_ioctl,
+	.compat_ioctl		= compat_ptr_ioctl,
+	.uring_cmd		= ws281x_part_uring_cmd,
+};
+
+static ssize_t priority_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct led_classdev_mc *mc_cdev = lcdev_to_mccdev(dev_get_drvdata(dev));
+	struct ws281x_led *ws281x_led = container_of(mc_cdev, struct ws281x_led, led);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(ws281x_led->priority));
+}
+
+static ssize_t priority_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t size)
+{
+	struct led_classdev_mc *mc_cdev = lcdev_to_mccdev(dev_get_drvdata(dev));
+	struct ws281x_led *ws281x_led = container_of(mc_cdev, struct ws281x_led, led);
+	bool priority;
+	int ret;
+
+	ret = kstrtobool(buf, &priority);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ws281x_led->priority, priority);
+
+	return size;
+}
+static DEVICE_ATTR_RW(priority);
+
+static struct attribute *ws281x_led_attrs[] = {
+	&dev_attr_priority.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(ws281x_led);
+
+static ssize_t master_brightness_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct ws281x_array *ws281x = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ws281x->master_brightness));
+}
+
+static ssize_t master_brightness_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t size)
+{
+	struct ws281x_array *ws281x = dev_get_drvdata(dev);
+	u8 brightness;
+	int ret;
+
+	ret = kstrtou8(buf, 0, &brightness);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ws281x->table_lock);
+	ws281x->master_brightness = brightness;
+	ret = ws281x_build_table(ws281x);
+	mutex_unlock(&ws281x->table_lock);
+
+	return ret ? ret : size;
+}
+static DEVICE_ATTR_RW(master_brightness);
+
+static struct attribute *ws281x_attrs[] = {
+	&dev_attr_master_brightness.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(ws281x);
+
+/**
+ * ws281x_register_led() - Register a single LED or LED segment
+ * @dev: Pointer to parent device.
+ * @ws281x: Driver data.
+ * @num: Index of the LED class device to register.
+ * @fwnode: Firmware node describing the LED class device.
+ * @first: Index of the first LED controlled by the class device.
+ * @count: Number of LEDs controlled by the class device.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_register_led(struct device *dev,
+			       struct ws281x_array *ws281x, int num,
+			       struct fwnode_handle *fwnode,
+			       u32 first, u32 count)
+{
+	struct mc_subled *mc_led_info;
+	struct led_init_data init_data = {};
+
+	mc_led_info = devm_kmalloc_array(dev, ws281x->info->ch_per_led,
+					 sizeof(*mc_led_info),
+					 GFP_KERNEL);
+	if (!mc_led_info)
+		return -ENOMEM;
+
+	init_data.fwnode = fwnode;
+
+	mc_led_info[0].color_index = LED_COLOR_ID_RED;
+	mc_led_info[1].color_index = LED_COLOR_ID_GREEN;
+	mc_led_info[2].color_index = LED_COLOR_ID_BLUE;
+
+	ws281x->leds[num].parent = ws281x;
+	ws281x->leds[num].first = first;
+	ws281x->leds[num].count = count;
+	ws281x->leds[num].priority = fwnode_property_read_bool(fwnode,
+							       "worldsemi,priority");
+	ws281x->leds[num].led.subled_info = mc_led_info;
+	ws281x->leds[num].led.num_colors = ws281x->info->ch_per_led;
+	ws281x->leds[num].led.led_cdev.brightness = LED_OFF;
+	ws281x->leds[num].led.led_cdev.max_brightness = LED_FULL;
+	ws281x->leds[num].led.led_cdev.brightness_set_blocking = \
+		ws281x_brightness_set_blocking;
+	ws281x->leds[num].led.led_cdev.groups = ws281x_led_groups;
+
+	return devm_led_classdev_multicolor_register_ext(ws281x->dev,
+							 &ws281x->leds[num].led,
+							 &init_data);
+}
+
+/**
+ * ws281x_register_leds() - Register each individual LED
+ * @dev: Pointer to parent device.
+ * @ws281x: Driver data.
+ *
+ * Iterate through each defined LED and register it as a multicolor LED.
+ * When the array node declares led-count, each child node instead
+ * describes a named segment of the array by its reg = <first count>,
+ * and an array without child nodes is registered as a single segment
+ * covering every LED.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_register_leds(struct device *dev,
+				struct ws281x_array *ws281x)
+{
+	struct fwnode_handle *parent_node = dev_fwnode(ws281x->dev);
+	struct fwnode_handle *child_node;
+	bool compact = device_property_present(ws281x->dev, "led-count");
+	u32 range[2];
+	int ret;
+	int num = 0;
+
+	if (compact && !device_get_child_node_count(ws281x->dev))
+		return ws281x_register_led(dev, ws281x, 0, parent_node,
+					   0, ws281x->num_leds);
+
+	fwnode_for_each_child_node(parent_node, child_node) {
+		range[0] = num;
+		range[1] = 1;
+
+		if (compact) {
+			ret = fwnode_property_read_u32_array(child_node, "reg",
+							     range, 2);
+			if (ret || !range[1] ||
+			    range[1] > ws281x->num_leds ||
+			    range[0] > ws281x->num_leds - range[1]) {
+				dev_err(dev, "Invalid range for %pfw\n",
+					child_node);
+				fwnode_handle_put(child_node);
+				return -EINVAL;
+			}
+		}
+
+		ret = ws281x_register_led(dev, ws281x, num, child_node,
+					  range[0], range[1]);
+		if (ret) {
+			fwnode_handle_put(child_node);
+			return ret;
+		}
+		num++;
+	}
+
+	return 0;
+}
+
+static struct dentry *ws281x_debugfs_root;
+
+static void ws281x_release_flush(void *data)
+{
+	struct ws281x_array *ws281x = data;
+
+	debugfs_remove_recursive(ws281x->debugfs);
+
+	/* Send out any change still waiting on the coalescing window. */
+	if (hrtimer_cancel(&ws281x->flush_timer))
+		queue_work(system_highpri_wq, &ws281x->flush_work);
+	flush_work(&ws281x->flush_work);
+
+	/* A fallback queued by that flush queues one more flush. */
+	disable_work_sync(&ws281x->fallback_work);
+	flush_work(&ws281x->flush_work);
+	ws281x_complete_latches(&ws281x->latches, -ENODEV);
+
+	vfree(ws281x->trace);
+	kfree(rcu_dereference_protected(ws281x->table, true));
+}
+
+static int ws281x_coalescing_show(struct seq_file *s, void *data)
+{
+	struct ws281x_array *ws281x = s->private;
+
+	seq_printf(s, "window_us: %u\n", ws281x->window_us);
+	seq_printf(s, "arrival_interval_us: %lu\n",
+		   ewma_ws281x_us_read(&ws281x->arrival_avg));
+	seq_printf(s, "frame_time_us: %lu\n",
+		   ewma_ws281x_us_read(&ws281x->frame_avg));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ws281x_coalescing);
+
+static int ws281x_stats_show(struct seq_file *s, void *data)
+{
+	struct ws281x_array *ws281x = s->private;
+
+	mutex_lock(&ws281x->mutex);
+	seq_printf(s, "ops: %llu\n", ws281x->stat_ops);
+	seq_printf(s, "flushes: %llu\n", ws281x->stat_flushes);
+	seq_printf(s, "latency_total_us: %llu\n", ws281x->stat_latency_us);
+	seq_printf(s, "latency_max_us: %llu\n", ws281x->stat_latency_max_us);
+	mutex_unlock(&ws281x->mutex);
+
+	return 0;
+}
+
+static ssize_t ws281x_stats_write(struct file *file, const char __user *buf,
+				  size_t len, loff_t *ppos)
+{
+	struct ws281x_array *ws281x = file_inode(file)->i_private;
+
+	mutex_lock(&ws281x->mutex);
+	ws281x->stat_ops = 0;
+	ws281x->stat_flushes = 0;
+	ws281x->stat_latency_us = 0;
+	ws281x->stat_latency_max_us = 0;
+	mutex_unlock(&ws281x->mutex);
+
+	return len;
+}
+DEFINE_SHOW_STORE_ATTRIBUTE(ws281x_stats);
+
+static int ws281x_wire_rate_show(struct seq_file *s, void *data)
+{
+	struct ws281x_array *ws281x = s->private;
+
+	mutex_lock(&ws281x->mutex);
+	seq_printf(s, "requested_hz: %u\n", ws281x->info->write_freq);
+	seq_printf(s, "achieved_bps: %u\n", ws281x->achieved_bps);
+	seq_printf(s, "suspect_xfers: %llu\n", ws281x->stat_suspect);
+	mutex_unlock(&ws281x->mutex);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ws281x_wire_rate);
+
+static int ws281x_encoder_show(struct seq_file *s, void *data)
+{
+	struct ws281x_array *ws281x = s->private;
+	const struct ws281x_encoder *enc;
+	const struct ws281x_enc_table *table;
+	int i;
+
+	rcu_read_lock();
+	table = rcu_dereference(ws281x->table);
+	for (i = 0; i < ARRAY_SIZE(ws281x_encoders); i++) {
+		enc = &ws281x_encoders[i];
+		if (!ws281x_encoder_usable(enc, table->info))
+			continue;
+		seq_printf(s, enc == table->enc ? "[%s] " : "%s ", enc->name);
+	}
+	rcu_read_unlock();
+	seq_puts(s, READ_ONCE(ws281x->encoder) ? "auto\n" : "[auto]\n");
+
+	return 0;
+}
+
+static ssize_t ws281x_encoder_write(struct file *file,
+				    const char __user *buf,
+				    size_t len, loff_t *ppos)
+{
+	struct ws281x_array *ws281x = file_inode(file)->i_private;
+	const struct ws281x_encoder *enc = NULL;
+	char name[16];
+	int ret = 0;
+
+	if (len >= sizeof(name))
+		return -EINVAL;
+	if (copy_from_user(name, buf, len))
+		return -EFAULT;
+	name[len] = '\0';
+
+	if (!sysfs_streq(name, "auto")) {
+		enc = ws281x_find_encoder(name);
+		if (!enc)
+			return -EINVAL;
+	}
+
+	mutex_lock(&ws281x->table_lock);
+	if (enc && !ws281x_encoder_usable(enc, ws281x->table_info)) {
+		ret = -EINVAL;
+	} else {
+		WRITE_ONCE(ws281x->encoder, enc);
+		ret = ws281x_build_table(ws281x);
+	}
+	mutex_unlock(&ws281x->table_lock);
+
+	return ret ? ret : len;
+}
+DEFINE_SHOW_STORE_ATTRIBUTE(ws281x_encoder);
+
+static ssize_t ws281x_trace_enable_write(struct file *file,
+					 const char __user *buf,
+					 size_t len, loff_t *ppos)
+{
+	struct ws281x_array *ws281x = file->private_data;
+	struct ws281x_trace_rec *trace = NULL;
+	bool enable;
+	int ret;
+
+	ret = kstrtobool_from_user(buf, len, &enable);
+	if (ret)
+		return ret;
+
+	if (enable) {
+		trace = vcalloc(WS281X_TRACE_LEN, sizeof(*trace));
+		if (!trace)
+			return -ENOMEM;
+	}
+
+	spin_lock(&ws281x->trace_lock);
+	if (!enable || !ws281x->trace) {
+		swap(ws281x->trace, trace);
+		ws281x->trace_head = 0;
+		ws281x->trace_tail = 0;
+	}
+	spin_unlock(&ws281x->trace_lock);
+
+	vfree(trace);
+
+	return len;
+}
+
+static const struct file_operations ws281x_trace_enable_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.write		= ws281x_trace_enable_write,
+};
+
+static ssize_t ws281x_trace_read(struct file *file, char __user *buf,
+				 size_t len, loff_t *ppos)
+{
+	struct ws281x_array *ws281x = file->private_data;
+	struct ws281x_trace_rec rec;
+	size_t done = 0;
+
+	while (len - done >= sizeof(rec)) {
+		spin_lock(&ws281x->trace_lock);
+		if (!ws281x->trace ||
+		    ws281x->trace_tail == ws281x->trace_head) {
+			spin_unlock(&ws281x->trace_lock);
+			break;
+		}
+		rec = ws281x->trace[ws281x->trace_tail++ % WS281X_TRACE_LEN];
+		spin_unlock(&ws281x->trace_lock);
+
+		if (copy_to_user(buf + done, &rec, sizeof(rec)))
+			return done ? done : -EFAULT;
+		done += sizeof(rec);
+	}
+
+	return done;
+}
+
+static const struct file_operations ws281x_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= ws281x_trace_read,
+};
+
+/**
+ * ws281x_replay_sparse() - Mark the LEDs of a sparse record dirty
+ * @ws281x: Driver data.
+ * @rec: WS281X_TRACE_SPARSE record.
+ *
+ * A sparse record describes a rectangle of value LEDs per row, whose
+ * lowest LED is first, so it is expanded again to its rows through the
+ * matrix layout of the array.
+ *
+ * Must be called with the mutex held.
+ *
+ * Return: 0 for success or error for an invalid record.
+ */
+static int ws281x_replay_sparse(struct ws281x_array *ws281x,
+				const struct ws281x_trace_rec *rec)
+{
+	u32 w = rec->value, width, h, row, x, i;
+	bool serpentine, flip;
+
+	if (!w || rec->count % w)
+		return -EINVAL;
+
+	h = rec->count / w;
+	if (h == 1) {
+		ws281x_mark_dirty(ws281x, rec->first, w);
+		return 0;
+	}
+
+	if (device_property_read_u32(ws281x->dev, "worldsemi,matrix-width",
+				     &width) || !width)
+		return -EINVAL;
+
+	row = rec->first / width;
+	x = rec->first % width;
+	if (w > width - x || h > ws281x->num_leds / width - row)
+		return -EINVAL;
+
+	/* Rows running the other way than the first one start mirrored. */
+	serpentine = device_property_read_bool(ws281x->dev,
+					       "worldsemi,matrix-serpentine");
+	for (i = 0; i < h; i++) {
+		flip = serpentine && (i & 1);
+		ws281x_mark_dirty(ws281x,
+				  ((row + i) * width) +
+				  (flip ? width - x - w : x), w);
+	}
+
+	return 0;
+}
+
+/*
+ * Records written to the replay file are applied as if the operation
+ * they describe had just happened, without touching the colors, so
+ * that a captured trace can be fed back to evaluate flush scheduling.
+ */
+static ssize_t ws281x_replay_write(struct file *file, const char __user *buf,
+				   size_t len, loff_t *ppos)
+{
+	struct ws281x_array *ws281x = file->private_data;
+	struct ws281x_trace_rec rec;
+	size_t done;
+	int ret;
+
+	for (done = 0; len - done >= sizeof(rec); done += sizeof(rec)) {
+		if (copy_from_user(&rec, buf + done, sizeof(rec)))
+			return done ? done : -EFAULT;
+
+		if (rec.op == WS281X_TRACE_FLUSH)
+			continue;
+
+		if (rec.first >= ws281x->num_leds ||
+		    rec.count > ws281x->num_leds - rec.first)
+			return done ? done : -EINVAL;
+
+		mutex_lock(&ws281x->mutex);
+		if (rec.op == WS281X_TRACE_SPARSE) {
+			ret = ws281x_replay_sparse(ws281x, &rec);
+			if (ret) {
+				mutex_unlock(&ws281x->mutex);
+				return done ? done : ret;
+			}
+		} else {
+			ws281x_mark_dirty(ws281x, rec.first, rec.count);
+		}
+		ws281x_trace(ws281x, rec.op, rec.first, rec.count, rec.value,
+			     rec.flags);
+		ws281x_schedule_flush(ws281x, ktime_get(),
+				      rec.flags & WS281X_TRACE_URGENT);
+		mutex_unlock(&ws281x->mutex);
+	}
+
+	return done;
+}
+
+static const struct file_operations ws281x_replay_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.write		= ws281x_replay_write,
+};
+
+/*
+ * The pixelstream file holds the wire data of the array as it is sent
+ * by the flushes (also in dry run mode), so that the encoding of any
+ * transport, UART included, can be checked from userspace.
+ */
+static ssize_t ws281x_pixelstream_read(struct file *file, char __user *buf,
+				       size_t len, loff_t *ppos)
+{
+	struct ws281x_array *ws281x = file->private_data;
+	ssize_t ret;
+
+	mutex_lock(&ws281x->mutex);
+	ret = simple_read_from_buffer(buf, len, ppos, ws281x->pixelstream,
+				      ws281x->num_leds *
+				      ws281x->info->pixel_sz);
+	mutex_unlock(&ws281x->mutex);
+
+	return ret;
+}
+
+static const struct file_operations ws281x_pixelstream_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= ws281x_pixelstream_read,
+	.llseek		= default_llseek,
+};
+
+/**
+ * ws281x_init_flush() - Set up the flush scheduling of an array
+ * @ws281x: Driver data.
+ *
+ * Seed the running frame time with the theoretical time to send the
+ * pixelstream and latch it, and expose the coalescing state in debugfs.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_init_flush(struct ws281x_array *ws281x)
+{
+	int ret;
+
+	ws281x->suspect_slack_us = 100;
+
+	INIT_WORK(&ws281x->flush_work, ws281x_flush_work);
+	INIT_WORK(&ws281x->fallback_work, ws281x_fallback_work);
+	hrtimer_setup(&ws281x->flush_timer, ws281x_flush_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+
+	ewma_ws281x_us_init(&ws281x->arrival_avg);
+	ewma_ws281x_us_init(&ws281x->frame_avg);
+	ewma_ws281x_us_add(&ws281x->frame_avg,
+			   ws281x_frame_time_us(ws281x, ws281x->num_leds));
+	spin_lock_init(&ws281x->trace_lock);
+	INIT_LIST_HEAD(&ws281x->latches);
+
+	ret = devm_mutex_init(ws281x->dev, &ws281x->table_lock);
+	if (ret)
+		return ret;
+
+	ret = devm_add_action_or_reset(ws281x->dev, ws281x_release_flush,
+				       ws281x);
+	if (ret)
+		return ret;
+
+	ws281x->table_info = ws281x->info;
+	ws281x->master_brightness = LED_FULL;
+	ret = ws281x_build_table(ws281x);
+	if (ret)
+		return ret;
+
+	/* Start from a valid encoding of every LED turned off. */
+	ws281x_update_pixelstream(ws281x);
+
+	ws281x->debugfs = debugfs_create_dir(dev_name(ws281x->dev),
+					     ws281x_debugfs_root);
+	debugfs_create_file("coalescing", 0444, ws281x->debugfs, ws281x,
+			    &ws281x_coalescing_fops);
+	debugfs_create_file("stats", 0644, ws281x->debugfs, ws281x,
+			    &ws281x_stats_fops);
+	debugfs_create_bool("dry_run", 0644, ws281x->debugfs,
+			    &ws281x->dry_run);
+	debugfs_create_file("wire_rate", 0444, ws281x->debugfs, ws281x,
+			    &ws281x_wire_rate_fops);
+	debugfs_create_file("encoder", 0644, ws281x->debugfs, ws281x,
+			    &ws281x_encoder_fops);
+	debugfs_create_u32("suspect_slack_us", 0644, ws281x->debugfs,
+			   &ws281x->suspect_slack_us);
+	debugfs_create_bool("auto_fallback", 0644, ws281x->debugfs,
+			    &ws281x->auto_fallback);
+	debugfs_create_file("trace_enable", 0200, ws281x->debugfs, ws281x,
+			    &ws281x_trace_enable_fops);
+	debugfs_create_file("trace", 0400, ws281x->debugfs, ws281x,
+			    &ws281x_trace_fops);
+	debugfs_create_file("replay", 0200, ws281x->debugfs, ws281x,
+			    &ws281x_replay_fops);
+	debugfs_create_file("pixelstream", 0400, ws281x->debugfs, ws281x,
+			    &ws281x_pixelstream_fops);
+
+	return 0;
+}
+
+/*
+ * Unregister the frame and wait for the file operations using it, the
+ * frame itself is freed once the last open file is released.
+ */
+static void ws281x_release_part(void *data)
+{
+	struct ws281x_part *part = data;
+
+	misc_deregister(&part->misc);
+
+	down_write(&part->lock);
+	part->gone = true;
+	up_write(&part->lock);
+
+	ws281x_exit_fences(part);
+	kref_put(&part->ref, ws281x_free_part);
+}
+
+/**
+ * ws281x_register_part() - Register a character device for a range of
+ * LEDs
+ * @ws281x: Driver data.
+ * @name: Name of the character device.
+ * @first: Index of the first LED of the range.
+ * @count: Number of LEDs in the range.
+ *
+ * The range is laid out as a matrix of worldsemi,matrix-width LEDs per
+ * row (a single row by default), running backwards on odd rows of the
+ * array when it has the worldsemi,matrix-serpentine property. A range
+ * that does not start a row of the array is kept as a single row.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_register_part(struct ws281x_array *ws281x,
+				const char *name, u32 first, u32 count)
+{
+	struct ws281x_part *part;
+	u32 width;
+	int ret;
+
+	part = kzalloc(sizeof(*part), GFP_KERNEL);
+	if (!part)
+		return -ENOMEM;
+
+	kref_init(&part->ref);
+	init_rwsem(&part->lock);
+	part->colors = vmalloc_user(count * ws281x->info->ch_per_led);
+	part->raw = vmalloc_user(count * ws281x->info->pixel_sz);
+	if (!part->colors || !part->raw) {
+		kref_put(&part->ref, ws281x_free_part);
+		return -ENOMEM;
+	}
+
+	part->parent = ws281x;
+	part->first = first;
+	part->count = count;
+	part->width = count;
+	if (!device_property_read_u32(ws281x->dev, "worldsemi,matrix-width",
+				      &width) && width && width <= count) {
+		if (first % width) {
+			dev_warn(ws281x->dev,
+				 "%s does not start a matrix row, using a single row\n",
+				 name);
+		} else {
+			part->width = width;
+			part->serpentine =
+				device_property_read_bool(ws281x->dev,
+							  "worldsemi,matrix-serpentine");
+		}
+	}
+	part->height = count / part->width;
+	ret = ws281x_init_fences(part);
+	if (ret) {
+		kref_put(&part->ref, ws281x_free_part);
+		return ret;
+	}
+
+	part->misc.minor = MISC_DYNAMIC_MINOR;
+	part->misc.name = name;
+	part->misc.fops = &ws281x_part_fops;
+	part->misc.parent = ws281x->dev;
+
+	ret = misc_register(&part->misc);
+	if (ret) {
+		ws281x_exit_fences(part);
+		kref_put(&part->ref, ws281x_free_part);
+		return ret;
+	}
+
+	return devm_add_action_or_reset(ws281x->dev, ws281x_release_part,
+					part);
+}
+
+/**
+ * ws281x_register_partitions() - Register a character device for each
+ * partition of the array
+ * @ws281x: Driver data.
+ *
+ * Partitions are declared by the worldsemi,partition-names property
+ * and the matching <first count> pairs of worldsemi,partitions. Each
+ * gets its own character device, so that separate users can own
+ * separate ranges of the array, while their commits are merged into
+ * the shared colors and flushed together.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_register_partitions(struct ws281x_array *ws281x)
+{
+	struct device *dev = ws281x->dev;
+	const char **names;
+	const char *name;
+	u32 first, count;
+	u32 *ranges;
+	int num, i, j, ret;
+
+	num = device_property_string_array_count(dev,
+						 "worldsemi,partition-names");
+	if (num == -EINVAL)
+		return 0;
+	if (num <= 0)
+		return num ? num : -EINVAL;
+
+	names = devm_kcalloc(dev, num, sizeof(*names), GFP_KERNEL);
+	ranges = devm_kcalloc(dev, num * 2, sizeof(*ranges), GFP_KERNEL);
+	if (!names || !ranges)
+		return -ENOMEM;
+
+	ret = device_property_read_string_array(dev,
+						"worldsemi,partition-names",
+						names, num);
+	if (ret < 0)
+		return ret;
+
+	ret = device_property_read_u32_array(dev, "worldsemi,partitions",
+					     ranges, num * 2);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < num; i++) {
+		first = ranges[i * 2];
+		count = ranges[i * 2 + 1];
+
+		if (!count || count > ws281x->num_leds ||
+		    first > ws281x->num_leds - count) {
+			dev_err(dev, "Invalid range for partition %s\n",
+				names[i]);
+			return -EINVAL;
+		}
+
+		for (j = 0; j < i; j++) {
+			if (first < ranges[j * 2] + ranges[j * 2 + 1] &&
+			    ranges[j * 2] < first + count) {
+				dev_err(dev, "Partition %s overlaps %s\n",
+					names[i], names[j]);
+				return -EINVAL;
+			}
+		}
+
+		name = devm_kasprintf(dev, GFP_KERNEL, "ws281x-%s-%s",
+				      dev_name(dev), names[i]);
+		if (!name)
+			return -ENOMEM;
+
+		ret = ws281x_register_part(ws281x, name, first, count);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * ws281x_register() - Register the interfaces of an array
+ * @ws281x: Driver data.
+ *
+ * Once the transport of the array is set up, start its flush scheduling
+ * and register its LED class devices and its character devices.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_register(struct ws281x_array *ws281x)
+{
+	struct device *dev = ws281x->dev;
+	const char *name;
+	int ret;
+
+	ret = ws281x_init_flush(ws281x);
+	if (ret)
+		return ret;
+
+	ret = ws281x_register_leds(dev, ws281x);
+	if (ret)
+		return dev_err_probe(dev, ret, "Cannot register LEDs\n");
+
+	name = devm_kasprintf(dev, GFP_KERNEL, "ws281x-%s", dev_name(dev));
+	if (!name)
+		return -ENOMEM;
+
+	ret = ws281x_register_part(ws281x, name, 0, ws281x->num_leds);
+	if (ret)
+		return dev_err_probe(dev, ret,
+				     "Cannot register frame device\n");
+
+	ret = ws281x_register_partitions(ws281x);
+	if (ret)
+		return dev_err_probe(dev, ret,
+				     "Cannot register partitions\n");
+
+	return 0;
+}
+
+/**
+ * ws281x_alloc_stripes() - Split the array in stripes
+ * @ws281x: Driver data.
+ * @count: Number of LEDs driven by the device of the array itself.
+ *
+ * An array can be extended by the SPI devices referenced by its
+ * worldsemi,stripes property, each driving led-count more LEDs on its
+ * own bus. The device of the array drives the first span of LEDs and
+ * each stripe the following ones, in order.
+ *
+ * Return: Total number of LEDs of the array or error for failure.
+ */
+static int ws281x_alloc_stripes(struct ws281x_array *ws281x, u32 count)
+{
+	struct device *dev = ws281x->dev;
+	struct fwnode_handle *fwnode;
+	u32 first = count;
+	int num, i, ret;
+
+	num = device_property_count_u32(dev, "worldsemi,stripes");
+	if (num < 0)
+		num = 0;
+
+	ws281x->stripes = devm_kcalloc(dev, num + 1, sizeof(*ws281x->stripes),
+				       GFP_KERNEL);
+	if (!ws281x->stripes)
+		return -ENOMEM;
+
+	ws281x->num_stripes = num + 1;
+	ws281x->stripes[0].count = count;
+
+	for (i = 1; i <= num; i++) {
+		fwnode = fwnode_find_reference(dev_fwnode(dev),
+					       "worldsemi,stripes", i - 1);
+		if (IS_ERR(fwnode))
+			return PTR_ERR(fwnode);
+
+		ret = fwnode_property_read_u32(fwnode, "led-count", &count);
+		fwnode_handle_put(fwnode);
+		if (ret || !count)
+			return dev_err_probe(dev, -EINVAL,
+					     "No LEDs defined for stripe %d\n",
+					     i);
+
+		ws281x->stripes[i].first = first;
+		ws281x->stripes[i].count = count;
+		first += count;
+	}
+
+	return first;
+}
+
+/**
+ * ws281x_alloc() - Allocate the driver data shared by all transports
+ * @dev: Pointer to device for this hardware.
+ *
+ * Return: Driver data on success or ERR_PTR on failure.
+ */
+static struct ws281x_array *ws281x_alloc(struct device *dev)
+{
+	struct ws281x_array *ws281x;
+	size_t num_segs;
+	u32 count;
+	int ret;
+
+	/*
+	 * Without led-count every child node describes a single LED,
+	 * otherwise the child nodes (if any) describe segments of the
+	 * array and the whole array is one segment when there are none.
+	 */
+	num_segs = device_get_child_node_count(dev);
+	if (device_property_read_u32(dev, "led-count", &count))
+		count = num_segs;
+	else if (!num_segs)
+		num_segs = 1;
+
+	if (!count)
+		return ERR_PTR(dev_err_probe(dev, -EINVAL,
+					     "No LEDs defined for control\n"));
+
+	ws281x = devm_kzalloc(dev, struct_size(ws281x, leds, num_segs),
+			      GFP_KERNEL);
+	if (!ws281x)
+		return ERR_PTR(-ENOMEM);
+
+	ws281x->num_segs = num_segs;
+	ws281x->dev = dev;
+	ws281x->info = device_get_match_data(dev);
+
+	ret = ws281x_alloc_stripes(ws281x, count);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	count = ret;
+	ws281x->num_leds = count;
+	atomic_set(&ws281x->xfer_pending, 0);
+	init_completion(&ws281x->xfer_done);
+
+	ret = devm_mutex_init(dev, &ws281x->mutex);
+	if (ret)
+		return ERR_PTR(dev_err_probe(dev, ret,
+					     "Could not get mutex\n"));
+
+	ws281x->pixelstream = devm_kcalloc(dev,
+					   (ws281x->info->pixel_sz * count),
+					   sizeof(uint8_t), GFP_KERNEL);
+	if (!ws281x->pixelstream)
+		return ERR_PTR(-ENOMEM);
+
+	ws281x->colors = devm_kcalloc(dev, count, ws281x->info->ch_per_led,
+				      GFP_KERNEL);
+	if (!ws281x->colors)
+		return ERR_PTR(-ENOMEM);
+
+	ws281x->dirty_map = devm_bitmap_zalloc(dev, count, GFP_KERNEL);
+	if (!ws281x->dirty_map)
+		return ERR_PTR(-ENOMEM);
+
+	ws281x->raw_map = devm_bitmap_zalloc(dev, count, GFP_KERNEL);
+	if (!ws281x->raw_map)
+		return ERR_PTR(-ENOMEM);
+
+	return ws281x;
+}
+
+static struct spi_driver ws281x_stripe_driver;
+
+static void ws281x_put_stripe(void *data)
+{
+	put_device(data);
+}
+
+/**
+ * ws281x_spi_setup_stripes() - Set up the SPI device of each stripe
+ * @ws281x: Driver data.
+ *
+ * The SPI device of each stripe must be bound to ws281x_stripe_driver,
+ * which keeps other drivers away from it, and the array is linked as its
+ * consumer so that it is unbound before the stripe.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int ws281x_spi_setup_stripes(struct ws281x_array *ws281x)
+{
+	struct device *dev = ws281x->dev;
+	struct fwnode_handle *fwnode;
+	struct device_link *link;
+	struct device *stripe_dev;
+	struct spi_device *spi;
+	bool bound;
+	int i, ret;
+
+	for (i = 0; i < ws281x->num_stripes; i++) {
+		spi = ws281x->spi;
+
+		if (i) {
+			fwnode = fwnode_find_reference(dev_fwnode(dev),
+						       "worldsemi,stripes",
+						       i - 1);
+			if (IS_ERR(fwnode))
+				return PTR_ERR(fwnode);
+
+			stripe_dev = bus_find_device_by_fwnode(&spi_bus_type,
+							       fwnode);
+			fwnode_handle_put(fwnode);
+			if (!stripe_dev)
+				return dev_err_probe(dev, -EPROBE_DEFER,
+						     "Stripe %d not found\n",
+						     i);
+
+			ret = devm_add_action_or_reset(dev, ws281x_put_stripe,
+						       stripe_dev);
+			if (ret)
+				return ret;
+
+			link = NULL;
+			device_lock(stripe_dev);
+			bound = stripe_dev->driver ==
+				&ws281x_stripe_driver.driver;
+			if (bound)
+				link = device_link_add(dev, stripe_dev,
+						       DL_FLAG_AUTOREMOVE_CONSUMER);
+			device_unlock(stripe_dev);
+			if (!bound)
+				return dev_err_probe(dev, -EPROBE_DEFER,
+						     "Stripe %d not bound\n",
+						     i);
+			if (!link)
+				return dev_err_probe(dev, -EINVAL,
+						     "Unable to link stripe %d\n",
+						     i);
+
+			spi = to_spi_device(stripe_dev);
+		}
+
+		spi->mode = SPI_MODE_0;
+		spi->bits_per_word = 8;
+		spi->max_speed_hz = ws281x->info->write_freq;
+
+		ret = spi_setup(spi);
+		if (ret)
+			return dev_err_probe(dev, ret,
+					     "Unable to set up SPI for ws281x\n");
+
+		ws281x->stripes[i].spi = spi;
+	}
+
+	return 0;
+}
+
+static int ws281x_spi_probe(struct spi_device *spi)
+{
+	struct device *dev = &spi->dev;
+	struct ws281x_array *ws281x;
+	int ret;
+
+	ws281x = ws281x_alloc(dev);
+	if (IS_ERR(ws281x))
+		return PTR_ERR(ws281x);
+
+	spi_set_drvdata(spi, ws281x);
+
+	ws281x->spi = spi;
+	ret = ws281x_spi_setup_stripes(ws281x);
+	if (ret)
+		return ret;
+
+	ws281x->xfer = ws281x_spi_xfer;
+
+	return ws281x_register(ws281x);
+}
+
+#if IS_REACHABLE(CONFIG_SERIAL_DEV_BUS)
+static size_t ws281x_serdev_receive_buf(struct serdev_device *serdev,
+					const u8 *data, size_t count)
+{
+	/* Nothing is expected back from the LEDs, discard it. */
+	return count;
+}
+
+static const struct serdev_device_ops ws281x_serdev_ops = {
+	.receive_buf		= ws281x_serdev_receive_buf,
+	.write_wakeup		= serdev_device_write_wakeup,
+};
+
+static int ws281x_serdev_probe(struct serdev_device *serdev)
+{
+	struct device *dev = &serdev->dev;
+	struct ws281x_array *ws281x;
+	unsigned int baud;
+	int ret;
+
+	ws281x = ws281x_alloc(dev);
+	if (IS_ERR(ws281x))
+		return PTR_ERR(ws281x);
+
+	if (ws281x->num_stripes > 1)
+		return dev_err_probe(dev, -EINVAL,
+				     "Stripes are only supported over SPI\n");
+
+	serdev_device_set_drvdata(serdev, ws281x);
+	serdev_device_set_client_ops(serdev, &ws281x_serdev_ops);
+
+	ret = devm_serdev_device_open(dev, serdev);
+	if (ret)
+		return dev_err_probe(dev, ret, "Unable to open UART\n");
+
+	baud = serdev_device_set_baudrate(serdev, ws281x->info->write_freq);
+	if (baud != ws281x->info->write_freq)
+		dev_warn(dev, "UART runs at %u baud instead of %u\n",
+			 baud, ws281x->info->write_freq);
+
+	serdev_device_set_flow_control(serdev, false);
+	ret = serdev_device_set_parity(serdev, SERDEV_PARITY_NONE);
+	if (ret)
+		return dev_err_probe(dev, ret,
+				     "Unable to set up UART for ws281x\n");
+
+	ws281x->serdev = serdev;
+	ws281x->xfer = ws281x_serdev_xfer;
+
+	return ws281x_register(ws281x);
+}
+#endif
+
+/*
+ * The datasheet for the ws2812b defines a 0 as high for 0.4us and low
+ * for 0.85us, and a 1 as high for 0.8us and low for 0.4us. By setting
+ * our transfer rate to 6.4Mhz (8 times the 800KHz refresh rate) this
+ * allows an SPI write of 0xc0 (11000000) to be interpreted as a 0 and
+ * 0xfc (11111100) to be interpreted as a 1.
+ */
+static const u8 ws2812b_spi_syms[] = { 0xc0, 0xfc };
+
+/*
+ * The same timing at half the rate: at 3.2Mhz a nibble of 1000 is
+ * interpreted as a 0 and 1110 as a 1, so each SPI byte carries two bits.
+ * This halves the size of the pixelstream for controllers that can not
+ * sustain 6.4Mhz without stalling.
+ */
+static const u8 ws2812b_spi4_syms[] = { 0x88, 0x8e, 0xe8, 0xee };
+
+static struct ws281x_chipinfo ws2812b_spi4_info __ro_after_init = {
+	.name = "ws2812b-spi4",
+	.sym_lut = ws2812b_spi4_syms,
+	.bits_per_sym = 2,
+	.write_freq = 3200000,
+	.frame_bits = BITS_PER_BYTE,
+	.subpixel_sz = (BITS_PER_BYTE / 2),
+	.ch_per_led = 3,
+	.pixel_sz = ((BITS_PER_BYTE / 2) * 3),
+};
+
+static struct ws281x_chipinfo ws2812b_info __ro_after_init = {
+	.name = "ws2812b-spi",
+	.sym_lut = ws2812b_spi_syms,
+	.bits_per_sym = 1,
+	.write_freq = 6400000,
+	.frame_bits = BITS_PER_BYTE,
+	.subpixel_sz = BITS_PER_BYTE,
+	.ch_per_led = 3,
+	.pixel_sz = (BITS_PER_BYTE * 3),
+	.fallback = &ws2812b_spi4_info,
+};
+
+/*
+ * Over a UART each byte goes out as 10 bit times (start bit, 8 data bits
+ * LSB first, stop bit). With the TX line inverted in hardware the start
+ * bit is high and the stop bit and idle line are low, so at 4Mbaud each
+ * frame can be split into two 1.25us ws2812b bits of 5 bit times each:
+ * a 0 is sent as 11000 (0.5us high, 0.75us low) and a 1 as 11100
+ * (0.75us high, 0.5us low). The table below holds the data byte that
+ * produces each combination of two bits, and an idle line latches the
+ * data once the last frame has been sent.
+ */
+static const u8 ws2812b_uart_syms[] = { 0xce, 0x8e, 0xcc, 0x8c };
+
+static struct ws281x_chipinfo ws2812b_uart_info __ro_after_init = {
+	.name = "ws2812b-uart",
+	.sym_lut = ws2812b_uart_syms,
+	.bits_per_sym = 2,
+	.write_freq = 4000000,
+	.frame_bits = 10,
+	.subpixel_sz = (BITS_PER_BYTE / 2),
+	.ch_per_led = 3,
+	.pixel_sz = ((BITS_PER_BYTE / 2) * 3),
+};
+
+static const struct of_device_id ws281x_spi_dt_ids[] = {
+	{ .compatible = "worldsemi,ws2812b-spi", .data = &ws2812b_info },
+	{},
+};
+MODULE_DEVICE_TABLE(of, ws281x_spi_dt_ids);
+
+static const struct spi_device_id ws281x_spi_ids[] = {
+	{ "ws2812b-spi", 0 },
 	{},
 };
 MODULE_DEVICE_TABLE(spi, ws281x_spi_ids);
@@ -347,12 +3335,228 @@ static struct spi_driver ws281x_spi_driver = {
 	.driver			= {
 		.name		= KBUILD_MODNAME,
 		.of_match_table	= ws281x_spi_dt_ids,
+		.dev_groups	= ws281x_groups,
 	},
 	.id_table		= ws281x_spi_ids,
 };
-module_spi_driver(ws281x_spi_driver);
+
+/*
+ * Stripes are driven by the array referencing them, they only bind so
+ * that no other driver can claim their SPI device.
+ */
+static int ws281x_stripe_probe(struct spi_device *spi)
+{
+	return 0;
+}
+
+static const struct of_device_id ws281x_stripe_dt_ids[] = {
+	{ .compatible = "worldsemi,ws2812b-spi-stripe" },
+	{},
+};
+MODULE_DEVICE_TABLE(of, ws281x_stripe_dt_ids);
+
+static const struct spi_device_id ws281x_stripe_ids[] = {
+	{ "ws2812b-spi-stripe", 0 },
+	{},
+};
+MODULE_DEVICE_TABLE(spi, ws281x_stripe_ids);
+
+static struct spi_driver ws281x_stripe_driver = {
+	.probe			= ws281x_stripe_probe,
+	.driver			= {
+		.name		= KBUILD_MODNAME "-stripe",
+		.of_match_table	= ws281x_stripe_dt_ids,
+	},
+	.id_table		= ws281x_stripe_ids,
+};
+
+#if IS_REACHABLE(CONFIG_SERIAL_DEV_BUS)
+static const struct of_device_id ws281x_serdev_dt_ids[] = {
+	{ .compatible = "worldsemi,ws2812b-uart", .data = &ws2812b_uart_info },
+	{},
+};
+MODULE_DEVICE_TABLE(of, ws281x_serdev_dt_ids);
+
+static struct serdev_device_driver ws281x_serdev_driver = {
+	.probe			= ws281x_serdev_probe,
+	.driver			= {
+		.name		= KBUILD_MODNAME,
+		.of_match_table	= ws281x_serdev_dt_ids,
+		.dev_groups	= ws281x_groups,
+	},
+};
+
+static int ws281x_serdev_register(void)
+{
+	return serdev_device_driver_register(&ws281x_serdev_driver);
+}
+
+static void ws281x_serdev_unregister(void)
+{
+	serdev_device_driver_unregister(&ws281x_serdev_driver);
+}
+#else
+static int ws281x_serdev_register(void)
+{
+	return 0;
+}
+
+static void ws281x_serdev_unregister(void)
+{
+}
+#endif
+
+static struct ws281x_chipinfo *ws281x_chips[] __initdata = {
+	&ws2812b_info,
+	&ws2812b_spi4_info,
+	&ws2812b_uart_info,
+};
+
+static char *encoder;
+module_param(encoder, charp, 0444);
+MODULE_PARM_DESC(encoder,
+		 "Encoder to use instead of the fastest one (scalar, table, word, spread)");
+
+/*
+ * Count the LEDs of a synthetic frame the encoder gets through in
+ * WS281X_BENCH_NS.
+ */
+static u64 __init ws281x_bench_encoder(const struct ws281x_encoder *enc,
+				       const struct ws281x_enc_table *table,
+				       u8 *buf, const u8 *colors)
+{
+	u64 leds = 0;
+	ktime_t end;
+
+	preempt_disable();
+	end = ktime_add_ns(ktime_get(), WS281X_BENCH_NS);
+	do {
+		enc->encode(table, buf, colors, WS281X_BENCH_LEDS);
+		leds += WS281X_BENCH_LEDS;
+	} while (ktime_before(ktime_get(), end));
+	preempt_enable();
+
+	return leds;
+}
+
+/**
+ * ws281x_select_encoders() - Choose the encoder of each encoding
+ *
+ * Time every encoder usable for each encoding, as the raid6 and xor code
+ * do for their implementations, and pick the fastest one for this CPU
+ * unless the encoder module parameter forces one.
+ *
+ * Return: 0 for success or error for failure.
+ */
+static int __init ws281x_select_encoders(void)
+{
+	const struct ws281x_encoder *forced = NULL, *best;
+	struct ws281x_chipinfo *info;
+	struct ws281x_enc_table *table;
+	u64 leds, best_leds;
+	u8 *colors, *buf;
+	int i, j;
+
+	if (encoder) {
+		forced = ws281x_find_encoder(encoder);
+		if (!forced)
+			pr_warn("unknown encoder %s\n", encoder);
+	}
+
+	table = kmalloc(sizeof(*table), GFP_KERNEL);
+	colors = kmalloc_array(WS281X_BENCH_LEDS, 3, GFP_KERNEL);
+	buf = kmalloc_array(WS281X_BENCH_LEDS, BITS_PER_BYTE * 3, GFP_KERNEL);
+	if (!table || !colors || !buf) {
+		kfree(table);
+		kfree(colors);
+		kfree(buf);
+		return -ENOMEM;
+	}
+	get_random_bytes(colors, WS281X_BENCH_LEDS * 3);
+
+	for (i = 0; i < ARRAY_SIZE(ws281x_chips); i++) {
+		info = ws281x_chips[i];
+		if (forced && ws281x_encoder_usable(forced, info)) {
+			pr_info("%s: using %s encoder (forced)\n", info->name,
+				forced->name);
+			info->encoder = forced;
+			continue;
+		}
+
+		ws281x_fill_table(table, info, LED_FULL);
+
+		best = NULL;
+		best_leds = 0;
+		for (j = 0; j < ARRAY_SIZE(ws281x_encoders); j++) {
+			if (!ws281x_encoder_usable(&ws281x_encoders[j], info))
+				continue;
+
+			leds = ws281x_bench_encoder(&ws281x_encoders[j], table,
+						    buf, colors);
+			pr_debug("%s: %s encodes %llu LEDs/ms\n", info->name,
+				 ws281x_encoders[j].name, leds);
+			if (leds > best_leds) {
+				best = &ws281x_encoders[j];
+				best_leds = leds;
+			}
+		}
+
+		pr_info("%s: using %s encoder (%llu LEDs/ms)\n", info->name,
+			best->name, best_leds);
+		info->encoder = best;
+	}
+
+	kfree(table);
+	kfree(colors);
+	kfree(buf);
+
+	return 0;
+}
+
+static int __init ws281x_init(void)
+{
+	int ret;
+
+	ret = ws281x_select_encoders();
+	if (ret)
+		return ret;
+
+	ws281x_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
+	ret = spi_register_driver(&ws281x_stripe_driver);
+	if (ret)
+		goto err_debugfs;
+
+	ret = spi_register_driver(&ws281x_spi_driver);
+	if (ret)
+		goto err_stripe;
+
+	ret = ws281x_serdev_register();
+	if (ret)
+		goto err_spi;
+
+	return 0;
+
+err_spi:
+	spi_unregister_driver(&ws281x_spi_driver);
+err_stripe:
+	spi_unregister_driver(&ws281x_stripe_driver);
+err_debugfs:
+	debugfs_remove_recursive(ws281x_debugfs_root);
+	return ret;
+}
+module_init(ws281x_init);
+
+static void __exit ws281x_exit(void)
+{
+	ws281x_serdev_unregister();
+	spi_unregister_driver(&ws281x_spi_driver);
+	spi_unregister_driver(&ws281x_stripe_driver);
+	debugfs_remove_recursive(ws281x_debugfs_root);
+}
+module_exit(ws281x_exit);
 
 MODULE_AUTHOR("Chris Morgan <macromorgan@hotmail.com>");
-MODULE_DESCRIPTION("WS281x Over SPI LED driver");
+MODULE_DESCRIPTION("WS281x Over SPI/UART LED driver");
 MODULE_LICENSE("GPL v2");
 MODULE_ALIAS("spi:ws281x-spi");
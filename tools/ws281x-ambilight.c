@@ -0,0 +1,400 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2025 Chris Morgan <macromorgan@hotmail.com>
+ *
+ * Mirror the edges of the screen on a strip of ws281x LEDs placed
+ * around it. Every vertical blank the buffer scanned out by a CRTC is
+ * imported through DRM PRIME, only the bands along its edges are read
+ * and averaged, and the result is written to the mapped frame of the
+ * array and committed.
+ *
+ * Usage:
+ *   ws281x-ambilight [-d card] [-c crtc] [-b band] -l top,right,bottom,left
+ *                    <ws281x device>
+ *
+ * The LEDs are expected to run clockwise from the top left corner of
+ * the screen, with the given number of LEDs along each edge. Only
+ * linear XRGB8888 and ARGB8888 scanout buffers are supported.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <linux/dma-buf.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "ws281x.h"
+
+/* Number of scanout buffers kept mapped, CRTCs usually flip between 2-3. */
+#define MAX_MAPS	4
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+struct scanout_map {
+	uint32_t fb_id;
+	int dmabuf;
+	uint8_t *base;
+	size_t size;
+	const uint8_t *pixels;
+	uint32_t pitch;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct edges {
+	unsigned int count[4];
+	unsigned int band;
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: ws281x-ambilight [-d card] [-c crtc] [-b band] "
+		"-l top,right,bottom,left <ws281x device>\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Average a rectangle of XRGB8888 pixels. Four pixels are summed at a
+ * time in vector lanes, with red and blue sharing a lane as two 16 bit
+ * fields, so the lanes are folded into the totals every 256 iterations
+ * before the blue field can overflow into red.
+ */
+static void average_rect(const struct scanout_map *map, unsigned int x0,
+			 unsigned int y0, unsigned int w, unsigned int h,
+			 uint8_t *rgb)
+{
+	uint64_t r = 0, g = 0, b = 0;
+	unsigned int x, y, i, n;
+
+	if (!w || !h) {
+		rgb[0] = rgb[1] = rgb[2] = 0;
+		return;
+	}
+
+	for (y = y0; y < y0 + h; y++) {
+		const uint8_t *row = map->pixels + (size_t)y * map->pitch +
+				     x0 * 4;
+
+		x = 0;
+		while (x + 4 <= w) {
+			v4u32 rb = { 0 }, gg = { 0 };
+
+			for (n = 0; x + 4 <= w && n < 256; x += 4, n++) {
+				v4u32 px;
+
+				memcpy(&px, row + x * 4, sizeof(px));
+				rb += px & 0x00ff00ff;
+				gg += (px >> 8) & 0xff;
+			}
+
+			for (i = 0; i < 4; i++) {
+				r += rb[i] >> 16;
+				b += rb[i] & 0xffff;
+				g += gg[i];
+			}
+		}
+
+		for (; x < w; x++) {
+			uint32_t px;
+
+			memcpy(&px, row + x * 4, sizeof(px));
+			r += (px >> 16) & 0xff;
+			g += (px >> 8) & 0xff;
+			b += px & 0xff;
+		}
+	}
+
+	n = w * h;
+	rgb[0] = r / n;
+	rgb[1] = g / n;
+	rgb[2] = b / n;
+}
+
+/*
+ * Fill the frame with the average of the band under each LED, going
+ * clockwise from the top left corner.
+ */
+static void sample_edges(const struct scanout_map *map,
+			 const struct edges *edges, uint8_t *frame,
+			 unsigned int ch)
+{
+	unsigned int w = map->width, h = map->height;
+	unsigned int band = edges->band;
+	unsigned int i, n, a, z;
+
+	if (band > w / 2)
+		band = w / 2;
+	if (band > h / 2)
+		band = h / 2;
+
+	n = edges->count[0];
+	for (i = 0; i < n; i++, frame += ch) {
+		a = i * w / n;
+		z = (i + 1) * w / n;
+		average_rect(map, a, 0, z - a, band, frame);
+	}
+
+	n = edges->count[1];
+	for (i = 0; i < n; i++, frame += ch) {
+		a = i * h / n;
+		z = (i + 1) * h / n;
+		average_rect(map, w - band, a, band, z - a, frame);
+	}
+
+	n = edges->count[2];
+	for (i = 0; i < n; i++, frame += ch) {
+		a = w - (i + 1) * w / n;
+		z = w - i * w / n;
+		average_rect(map, a, h - band, z - a, band, frame);
+	}
+
+	n = edges->count[3];
+	for (i = 0; i < n; i++, frame += ch) {
+		a = h - (i + 1) * h / n;
+		z = h - i * h / n;
+		average_rect(map, 0, a, band, z - a, frame);
+	}
+}
+
+static void unmap_scanout(struct scanout_map *map)
+{
+	if (map->base)
+		munmap(map->base, map->size);
+	if (map->dmabuf >= 0)
+		close(map->dmabuf);
+	memset(map, 0, sizeof(*map));
+	map->dmabuf = -1;
+}
+
+/* Import a framebuffer through PRIME and map it for reading. */
+static int map_scanout(int drm, uint32_t fb_id, struct scanout_map *map)
+{
+	drmModeFB2Ptr fb;
+	int ret = -1;
+
+	fb = drmModeGetFB2(drm, fb_id);
+	if (!fb) {
+		fprintf(stderr, "fb %u: %s\n", fb_id, strerror(errno));
+		return -1;
+	}
+
+	if ((fb->pixel_format != DRM_FORMAT_XRGB8888 &&
+	     fb->pixel_format != DRM_FORMAT_ARGB8888) ||
+	    ((fb->flags & DRM_MODE_FB_MODIFIERS) &&
+	     fb->modifier != DRM_FORMAT_MOD_LINEAR)) {
+		fprintf(stderr, "fb %u: unsupported format\n", fb_id);
+		goto out;
+	}
+
+	if (drmPrimeHandleToFD(drm, fb->handles[0], DRM_CLOEXEC,
+			       &map->dmabuf)) {
+		fprintf(stderr, "fb %u: %s\n", fb_id, strerror(errno));
+		goto out;
+	}
+
+	map->size = (size_t)fb->pitches[0] * fb->height + fb->offsets[0];
+	map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED,
+			 map->dmabuf, 0);
+	if (map->base == MAP_FAILED) {
+		fprintf(stderr, "fb %u: %s\n", fb_id, strerror(errno));
+		map->base = NULL;
+		unmap_scanout(map);
+		goto out;
+	}
+
+	map->fb_id = fb_id;
+	map->pitch = fb->pitches[0];
+	map->width = fb->width;
+	map->height = fb->height;
+	map->pixels = map->base + fb->offsets[0];
+	ret = 0;
+
+out:
+	drmCloseBufferHandle(drm, fb->handles[0]);
+	drmModeFreeFB2(fb);
+	return ret;
+}
+
+static struct scanout_map *get_scanout(int drm, uint32_t fb_id,
+				       struct scanout_map *maps)
+{
+	static unsigned int next;
+	struct scanout_map *map;
+	unsigned int i;
+
+	for (i = 0; i < MAX_MAPS; i++)
+		if (maps[i].fb_id == fb_id)
+			return &maps[i];
+
+	map = &maps[next++ % MAX_MAPS];
+	unmap_scanout(map);
+	if (map_scanout(drm, fb_id, map))
+		return NULL;
+
+	return map;
+}
+
+static int wait_vblank(int drm, unsigned int crtc_index)
+{
+	drmVBlank vbl = {};
+
+	vbl.request.type = DRM_VBLANK_RELATIVE;
+	if (crtc_index == 1)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	else if (crtc_index > 1)
+		vbl.request.type |= (crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+				    DRM_VBLANK_HIGH_CRTC_MASK;
+	vbl.request.sequence = 1;
+
+	return drmWaitVBlank(drm, &vbl);
+}
+
+/* Find the CRTC to sample, the first active one unless one is given. */
+static int find_crtc(int drm, uint32_t *crtc_id, unsigned int *crtc_index)
+{
+	drmModeResPtr res;
+	drmModeCrtcPtr crtc;
+	int i, ret = -1;
+
+	res = drmModeGetResources(drm);
+	if (!res) {
+		fprintf(stderr, "drm: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < res->count_crtcs; i++) {
+		if (*crtc_id && res->crtcs[i] != *crtc_id)
+			continue;
+
+		crtc = drmModeGetCrtc(drm, res->crtcs[i]);
+		if (crtc && crtc->mode_valid && crtc->buffer_id) {
+			*crtc_id = crtc->crtc_id;
+			*crtc_index = i;
+			ret = 0;
+		}
+		drmModeFreeCrtc(crtc);
+		if (!ret)
+			break;
+	}
+
+	if (ret)
+		fprintf(stderr, "no active crtc found\n");
+
+	drmModeFreeResources(res);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct scanout_map maps[MAX_MAPS];
+	struct ws281x_ioc_info info;
+	struct edges edges = { .band = 32 };
+	const char *card = "/dev/dri/card0";
+	unsigned int crtc_index, total, i;
+	uint32_t crtc_id = 0;
+	drmModeCrtcPtr crtc;
+	struct dma_buf_sync sync;
+	struct scanout_map *map;
+	uint8_t *frame;
+	int drm, leds, opt;
+
+	while ((opt = getopt(argc, argv, "d:c:b:l:")) != -1) {
+		switch (opt) {
+		case 'd':
+			card = optarg;
+			break;
+		case 'c':
+			crtc_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			edges.band = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			if (sscanf(optarg, "%u,%u,%u,%u", &edges.count[0],
+				   &edges.count[1], &edges.count[2],
+				   &edges.count[3]) != 4)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	total = edges.count[0] + edges.count[1] + edges.count[2] +
+		edges.count[3];
+	if (argc - optind != 1 || !total || !edges.band)
+		usage();
+
+	leds = open(argv[optind], O_RDWR | O_CLOEXEC);
+	if (leds < 0 || ioctl(leds, WS281X_IOC_INFO, &info)) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (info.num_leds < total) {
+		fprintf(stderr, "%s: only %u LEDs\n", argv[optind],
+			info.num_leds);
+		return EXIT_FAILURE;
+	}
+
+	frame = mmap(NULL, (size_t)info.num_leds * info.ch_per_led,
+		     PROT_READ | PROT_WRITE, MAP_SHARED, leds, 0);
+	if (frame == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	drm = open(card, O_RDWR | O_CLOEXEC);
+	if (drm < 0) {
+		fprintf(stderr, "%s: %s\n", card, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (find_crtc(drm, &crtc_id, &crtc_index))
+		return EXIT_FAILURE;
+
+	for (i = 0; i < MAX_MAPS; i++) {
+		memset(&maps[i], 0, sizeof(maps[i]));
+		maps[i].dmabuf = -1;
+	}
+
+	for (;;) {
+		if (wait_vblank(drm, crtc_index)) {
+			fprintf(stderr, "vblank: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		/* The scanout buffer changes with every page flip. */
+		crtc = drmModeGetCrtc(drm, crtc_id);
+		if (!crtc)
+			return EXIT_FAILURE;
+		map = crtc->buffer_id ?
+		      get_scanout(drm, crtc->buffer_id, maps) : NULL;
+		drmModeFreeCrtc(crtc);
+		if (!map)
+			continue;
+
+		sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+		ioctl(map->dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+		sample_edges(map, &edges, frame, info.ch_per_led);
+		sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+		ioctl(map->dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+
+		if (ioctl(leds, WS281X_IOC_COMMIT)) {
+			fprintf(stderr, "commit: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,386 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2025 Chris Morgan <macromorgan@hotmail.com>
+ *
+ * Record the operations hitting a ws281x array, and replay a recording
+ * against the array to evaluate how the driver schedules flushes.
+ *
+ * Usage:
+ *   ws281x-replay record <debugfs dir> <file>
+ *   ws281x-replay replay [-s speed] [-w] <debugfs dir> <file>
+ *   ws281x-replay check <debugfs dir> <frame device>
+ *
+ * where <debugfs dir> is /sys/kernel/debug/leds-ws281x-spi/<device>.
+ * Replay runs in dry run mode (no bus transfers, only the time they
+ * would take) unless -w is given. Check commits a test pattern to the
+ * frame device of the whole array in dry run mode and decodes the
+ * pixelstream the driver encoded for it, whatever the transport.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ws281x.h"
+
+struct ws281x_stats {
+	unsigned long long ops;
+	unsigned long long flushes;
+	unsigned long long latency_total_us;
+	unsigned long long latency_max_us;
+};
+
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: ws281x-replay record <debugfs dir> <file>\n"
+		"       ws281x-replay replay [-s speed] [-w] <debugfs dir> <file>\n"
+		"       ws281x-replay check <debugfs dir> <frame device>\n");
+	exit(EXIT_FAILURE);
+}
+
+static int open_attr(const char *dir, const char *name, int flags)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, flags);
+	if (fd < 0)
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+
+	return fd;
+}
+
+static int write_attr(const char *dir, const char *name, const char *val)
+{
+	int fd = open_attr(dir, name, O_WRONLY);
+	ssize_t ret;
+
+	if (fd < 0)
+		return -1;
+
+	ret = write(fd, val, strlen(val));
+	close(fd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int read_stats(const char *dir, struct ws281x_stats *stats)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/stats", dir);
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	ret = fscanf(f, "ops: %llu flushes: %llu latency_total_us: %llu "
+		     "latency_max_us: %llu", &stats->ops, &stats->flushes,
+		     &stats->latency_total_us, &stats->latency_max_us);
+	fclose(f);
+
+	return ret == 4 ? 0 : -1;
+}
+
+static int record(const char *dir, const char *file)
+{
+	struct ws281x_trace_rec recs[256];
+	unsigned long total = 0;
+	ssize_t len;
+	int fd, out;
+
+	out = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	fd = open_attr(dir, "trace", O_RDONLY);
+	if (fd < 0 || write_attr(dir, "trace_enable", "1")) {
+		if (fd >= 0)
+			close(fd);
+		close(out);
+		return -1;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	fprintf(stderr, "recording, interrupt to stop\n");
+
+	while (!stop) {
+		len = read(fd, recs, sizeof(recs));
+		if (len < 0 && errno != EINTR)
+			break;
+		if (len > 0) {
+			if (write(out, recs, len) != len)
+				break;
+			total += len / sizeof(recs[0]);
+		} else {
+			usleep(100000);
+		}
+	}
+
+	/* Disabling the trace drops the ring, so save what is left first. */
+	while ((len = read(fd, recs, sizeof(recs))) > 0) {
+		if (write(out, recs, len) != len)
+			break;
+		total += len / sizeof(recs[0]);
+	}
+
+	write_attr(dir, "trace_enable", "0");
+	close(fd);
+	close(out);
+	fprintf(stderr, "recorded %lu operations\n", total);
+
+	return 0;
+}
+
+static void timespec_add_ns(struct timespec *ts, unsigned long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static int replay(const char *dir, const char *file, double speed, int wire)
+{
+	struct ws281x_stats stats;
+	struct ws281x_trace_rec rec;
+	struct timespec start, when;
+	unsigned long long first_ts = 0;
+	int in, fd, ret = 0;
+
+	in = open(file, O_RDONLY);
+	if (in < 0) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	fd = open_attr(dir, "replay", O_WRONLY);
+	if (fd < 0 || write_attr(dir, "dry_run", wire ? "0" : "1") ||
+	    write_attr(dir, "stats", "0")) {
+		close(in);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (read(in, &rec, sizeof(rec)) == sizeof(rec)) {
+		if (rec.op == WS281X_TRACE_FLUSH)
+			continue;
+
+		if (!first_ts)
+			first_ts = rec.ts_ns;
+
+		when = start;
+		timespec_add_ns(&when, (rec.ts_ns - first_ts) / speed);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL);
+
+		if (write(fd, &rec, sizeof(rec)) != sizeof(rec)) {
+			fprintf(stderr, "replay: %s\n", strerror(errno));
+			ret = -1;
+			break;
+		}
+	}
+
+	/* Give the last coalesced flush time to go out. */
+	usleep(100000);
+
+	if (!ret && !read_stats(dir, &stats)) {
+		printf("operations:      %llu\n", stats.ops);
+		printf("transfers:       %llu\n", stats.flushes);
+		if (stats.flushes) {
+			printf("coalescing:      %.2f ops/transfer\n",
+			       (double)stats.ops / stats.flushes);
+			printf("latency avg:     %llu us\n",
+			       stats.latency_total_us / stats.flushes);
+		}
+		printf("latency max:     %llu us\n", stats.latency_max_us);
+	}
+
+	write_attr(dir, "dry_run", "0");
+	close(fd);
+	close(in);
+
+	return ret;
+}
+
+/* Wire order of the subpixels, in red, green, blue frame order. */
+static const unsigned int grb[] = { 1, 0, 2 };
+
+/*
+ * Decode the wire data of an LED with the symbols of the encoding, MSB
+ * first, and return the index of the first subpixel not matching its
+ * color, or -1 when they all do.
+ */
+static int check_led(const struct ws281x_ioc_raw_info *raw,
+		     const uint8_t *wire, const uint8_t *color)
+{
+	unsigned int sz = raw->pixel_sz / 3;
+	unsigned int i, j, s, val;
+
+	for (i = 0; i < 3; i++) {
+		val = 0;
+		for (j = 0; j < sz; j++, wire++) {
+			for (s = 0; s < (1U << raw->bits_per_sym); s++)
+				if (raw->syms[s] == *wire)
+					break;
+			if (s == (1U << raw->bits_per_sym))
+				return i;
+			val = (val << raw->bits_per_sym) | s;
+		}
+		if (val != color[grb[i]])
+			return i;
+	}
+
+	return -1;
+}
+
+static int check(const char *dir, const char *frame)
+{
+	struct ws281x_ioc_raw_info raw;
+	struct ws281x_ioc_info info;
+	uint8_t *colors = NULL, *wire = NULL;
+	size_t frame_len, wire_len, i;
+	int fd, ps = -1, tries, bad = -1;
+	int ret = -1;
+	uint32_t led;
+
+	fd = open(frame, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", frame, strerror(errno));
+		return -1;
+	}
+
+	if (ioctl(fd, WS281X_IOC_INFO, &info) ||
+	    ioctl(fd, WS281X_IOC_RAW_INFO, &raw)) {
+		fprintf(stderr, "%s: %s\n", frame, strerror(errno));
+		goto out;
+	}
+
+	frame_len = (size_t)info.num_leds * info.ch_per_led;
+	wire_len = (size_t)info.num_leds * raw.pixel_sz;
+	colors = malloc(frame_len);
+	wire = malloc(wire_len);
+	if (!colors || !wire)
+		goto out;
+
+	/* Every color value, spread over the LEDs and their subpixels. */
+	for (i = 0; i < frame_len; i++)
+		colors[i] = i * 37 + i / 256;
+
+	ps = open_attr(dir, "pixelstream", O_RDONLY);
+	if (ps < 0 || write_attr(dir, "dry_run", "1"))
+		goto out;
+
+	if (pwrite(fd, colors, frame_len, 0) != (ssize_t)frame_len) {
+		fprintf(stderr, "%s: %s\n", frame, strerror(errno));
+		goto restore;
+	}
+
+	/* Wait for a flush to have encoded the whole pattern. */
+	for (tries = 0; tries < 100; tries++) {
+		if (pread(ps, wire, wire_len, 0) != (ssize_t)wire_len) {
+			fprintf(stderr, "pixelstream: short read\n");
+			goto restore;
+		}
+
+		for (led = 0; led < info.num_leds; led++) {
+			bad = check_led(&raw, wire + led * raw.pixel_sz,
+					colors + led * info.ch_per_led);
+			if (bad >= 0)
+				break;
+		}
+		if (bad < 0)
+			break;
+
+		usleep(10000);
+	}
+
+	if (bad >= 0) {
+		fprintf(stderr, "LED %u: subpixel %c does not match\n", led,
+			"RGB"[grb[bad]]);
+		goto restore;
+	}
+
+	printf("pixelstream of %u LEDs (%zu bytes) matches\n", info.num_leds,
+	       wire_len);
+	ret = 0;
+
+restore:
+	write_attr(dir, "dry_run", "0");
+out:
+	if (ps >= 0)
+		close(ps);
+	free(wire);
+	free(colors);
+	close(fd);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	double speed = 1.0;
+	int wire = 0;
+	int opt;
+
+	if (argc < 2)
+		usage();
+
+	if (!strcmp(argv[1], "record")) {
+		if (argc != 4)
+			usage();
+		return record(argv[2], argv[3]) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!strcmp(argv[1], "check")) {
+		if (argc != 4)
+			usage();
+		return check(argv[2], argv[3]) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (strcmp(argv[1], "replay"))
+		usage();
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "s:w")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = strtod(optarg, NULL);
+			if (speed <= 0)
+				usage();
+			break;
+		case 'w':
+			wire = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (argc - optind != 2)
+		usage();
+
+	return replay(argv[optind], argv[optind + 1], speed, wire) ?
+	       EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,271 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (C) 2025 Chris Morgan <macromorgan@hotmail.com>
+ *
+ * Userspace interface of the WS281x LED driver.
+ */
+
+#ifndef _WS281X_H
+#define _WS281X_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Each array has a character device, /dev/ws281x-<device>, giving access
+ * to the colors of its LEDs as a frame of ch_per_led bytes per LED in
+ * red, green, blue order. Writing to it updates the frame at the file
+ * position and sends the LEDs touched by the write to the array.
+ * Alternatively the frame can be mapped with mmap(), updated in place
+ * and committed to the array with WS281X_IOC_COMMIT.
+ *
+ * The frame can also be drawn to as a matrix of width x height LEDs with
+ * the blitter ioctls, which only commit the rectangle they draw to.
+ *
+ * WS281X_IOC_COMMIT_FENCE commits the whole frame asynchronously, once
+ * an optional sync_file in-fence signals, and can return a sync_file
+ * out-fence signaling once the LEDs latched the commit. Fenced commits
+ * of a character device are committed in the order they were submitted,
+ * and their out-fences share a single timeline.
+ *
+ * Commits can also be submitted asynchronously with io_uring, as
+ * IORING_OP_URING_CMD commands carrying their argument in the command
+ * area of the SQE. Their completion is posted once the LEDs latched the
+ * commit, with a result of 0 or a negative error.
+ *
+ * LEDs can also be given raw wire data, already encoded by userspace,
+ * with WS281X_IOC_RAW. The data is sent as is, without the master
+ * brightness applied, until the LEDs are given a color again.
+ */
+
+/**
+ * struct ws281x_ioc_info - Layout of the frame of a character device.
+ *
+ * @num_leds: Number of LEDs in the frame.
+ * @ch_per_led: Number of bytes per LED in the frame.
+ * @width: Number of LEDs per row of the matrix.
+ * @height: Number of rows of the matrix.
+ */
+struct ws281x_ioc_info {
+	__u32 num_leds;
+	__u32 ch_per_led;
+	__u32 width;
+	__u32 height;
+};
+
+/**
+ * struct ws281x_rect - Rectangle of the matrix.
+ *
+ * @x: Column of the top left LED.
+ * @y: Row of the top left LED.
+ * @w: Number of columns.
+ * @h: Number of rows.
+ */
+struct ws281x_rect {
+	__u32 x;
+	__u32 y;
+	__u32 w;
+	__u32 h;
+};
+
+/**
+ * struct ws281x_blit_fill - Fill a rectangle with a color.
+ *
+ * @rect: Rectangle to fill.
+ * @color: Color of the rectangle.
+ */
+struct ws281x_blit_fill {
+	struct ws281x_rect rect;
+	__u8 color[4];
+};
+
+/**
+ * struct ws281x_blit_copy - Copy a rectangle within the matrix.
+ *
+ * @src: Rectangle to copy, it may overlap the destination.
+ * @dst_x: Column of the top left LED of the destination.
+ * @dst_y: Row of the top left LED of the destination.
+ */
+struct ws281x_blit_copy {
+	struct ws281x_rect src;
+	__u32 dst_x;
+	__u32 dst_y;
+};
+
+/* Leave the LEDs under sprite pixels matching the key color untouched. */
+#define WS281X_SPRITE_KEY		(1 << 0)
+
+/**
+ * struct ws281x_blit_sprite - Draw a sprite.
+ *
+ * @rect: Rectangle to draw the sprite to.
+ * @data: Pointer to the w * h pixels of the sprite, row by row, in the
+ * layout of the frame.
+ * @key: Transparent color when WS281X_SPRITE_KEY is set.
+ * @flags: WS281X_SPRITE_* flags.
+ */
+struct ws281x_blit_sprite {
+	struct ws281x_rect rect;
+	__u64 data;
+	__u8 key[4];
+	__u32 flags;
+};
+
+/* Run the gradient from the top to the bottom row instead of left to right. */
+#define WS281X_GRADIENT_VERTICAL	(1 << 0)
+
+/**
+ * struct ws281x_blit_gradient - Fill a rectangle with a linear gradient.
+ *
+ * @rect: Rectangle to fill.
+ * @from: Color of the first column (or row).
+ * @to: Color of the last column (or row).
+ * @flags: WS281X_GRADIENT_* flags.
+ */
+struct ws281x_blit_gradient {
+	struct ws281x_rect rect;
+	__u8 from[4];
+	__u8 to[4];
+	__u32 flags;
+};
+
+/**
+ * struct ws281x_ioc_raw_info - Current wire encoding of the array.
+ *
+ * @pixel_sz: Number of wire bytes per LED, with the subpixels in green,
+ * red, blue order.
+ * @bits_per_sym: Number of LED bits carried by each wire byte.
+ * @syms: Wire byte for each value of a group of bits_per_sym bits, MSB
+ * first. Only these bytes may appear in raw wire data.
+ */
+struct ws281x_ioc_raw_info {
+	__u32 pixel_sz;
+	__u32 bits_per_sym;
+	__u8 syms[4];
+};
+
+/* Commit the data from the mapped staging buffer instead of data. */
+#define WS281X_RAW_MAPPED		(1 << 0)
+
+/*
+ * mmap() offset of the staging buffer for raw wire data, laid out as
+ * pixel_sz bytes per LED of the frame.
+ */
+#define WS281X_RAW_OFFSET		0x10000000
+
+/**
+ * struct ws281x_raw - Send raw wire data to a range of LEDs.
+ *
+ * @data: Pointer to count * pixel_sz bytes of wire data.
+ * @first: Index of the first LED of the range.
+ * @count: Number of LEDs in the range.
+ * @flags: WS281X_RAW_* flags.
+ * @pad: Must be zero.
+ *
+ * Fails with EINVAL when the data holds bytes which are not symbols of
+ * the encoding, and with EAGAIN when the encoding changed, after which
+ * it should be queried again with WS281X_IOC_RAW_INFO.
+ */
+struct ws281x_raw {
+	__u64 data;
+	__u32 first;
+	__u32 count;
+	__u32 flags;
+	__u32 pad;
+};
+
+/* Wait for in_fence before committing the frame. */
+#define WS281X_COMMIT_IN_FENCE		(1 << 0)
+/* Return an out-fence in out_fence. */
+#define WS281X_COMMIT_OUT_FENCE		(1 << 1)
+
+/**
+ * struct ws281x_commit - Commit the frame with sync_file fences.
+ *
+ * @in_fence: sync_file fd to wait for with WS281X_COMMIT_IN_FENCE. When
+ * it signals with an error the frame is not committed and the out-fence
+ * signals with the same error.
+ * @out_fence: Returned sync_file fd with WS281X_COMMIT_OUT_FENCE, which
+ * signals once the flush carrying the frame was latched by the LEDs.
+ * @flags: WS281X_COMMIT_* flags.
+ * @pad: Must be zero.
+ */
+struct ws281x_commit {
+	__s32 in_fence;
+	__s32 out_fence;
+	__u32 flags;
+	__u32 pad;
+};
+
+/**
+ * struct ws281x_range - Range of LEDs of the frame.
+ *
+ * @first: Index of the first LED of the range.
+ * @count: Number of LEDs in the range.
+ */
+struct ws281x_range {
+	__u32 first;
+	__u32 count;
+};
+
+#define WS281X_IOC_MAGIC		0xb7
+
+#define WS281X_IOC_INFO		_IOR(WS281X_IOC_MAGIC, 0, struct ws281x_ioc_info)
+#define WS281X_IOC_COMMIT	_IO(WS281X_IOC_MAGIC, 1)
+#define WS281X_IOC_FILL		_IOW(WS281X_IOC_MAGIC, 2, struct ws281x_blit_fill)
+#define WS281X_IOC_COPY		_IOW(WS281X_IOC_MAGIC, 3, struct ws281x_blit_copy)
+#define WS281X_IOC_SPRITE	_IOW(WS281X_IOC_MAGIC, 4, struct ws281x_blit_sprite)
+#define WS281X_IOC_GRADIENT	_IOW(WS281X_IOC_MAGIC, 5, struct ws281x_blit_gradient)
+#define WS281X_IOC_RAW_INFO	_IOR(WS281X_IOC_MAGIC, 6, struct ws281x_ioc_raw_info)
+#define WS281X_IOC_RAW		_IOW(WS281X_IOC_MAGIC, 7, struct ws281x_raw)
+#define WS281X_IOC_COMMIT_FENCE	_IOWR(WS281X_IOC_MAGIC, 8, struct ws281x_commit)
+
+/* io_uring command opcodes, the cmd_op of IORING_OP_URING_CMD. */
+#define WS281X_URING_COMMIT	_IOW(WS281X_IOC_MAGIC, 0x40, struct ws281x_range)
+#define WS281X_URING_SPARSE	_IOW(WS281X_IOC_MAGIC, 0x41, struct ws281x_rect)
+
+/**
+ * enum ws281x_trace_op - Operations recorded in the trace of an array.
+ *
+ * @WS281X_TRACE_BRIGHTNESS: Brightness of an LED or segment was set.
+ * @WS281X_TRACE_FLUSH: The colors were sent to the LEDs.
+ * @WS281X_TRACE_BULK: A range of a frame was committed.
+ * @WS281X_TRACE_SPARSE: A rectangle of the matrix of a frame was
+ * committed, first is the lowest LED of the rectangle, count its number
+ * of LEDs and value its width.
+ * @WS281X_TRACE_RAW: Raw wire data was committed to a range of a frame.
+ */
+enum ws281x_trace_op {
+	WS281X_TRACE_BRIGHTNESS = 1,
+	WS281X_TRACE_FLUSH,
+	WS281X_TRACE_BULK,
+	WS281X_TRACE_SPARSE,
+	WS281X_TRACE_RAW,
+};
+
+/* The operation bypassed flush coalescing. */
+#define WS281X_TRACE_URGENT		(1 << 0)
+
+/**
+ * struct ws281x_trace_rec - A single record of the trace of an array.
+ *
+ * @ts_ns: CLOCK_MONOTONIC time of the operation in nanoseconds.
+ * @first: Index of the first LED touched by the operation.
+ * @count: Number of LEDs touched by the operation.
+ * @op: One of enum ws281x_trace_op.
+ * @flags: WS281X_TRACE_* flags.
+ * @value: Brightness for WS281X_TRACE_BRIGHTNESS, 0 for
+ * WS281X_TRACE_BULK and WS281X_TRACE_RAW, width of the rectangle for
+ * WS281X_TRACE_SPARSE, or duration of the transfer in microseconds for
+ * WS281X_TRACE_FLUSH.
+ */
+struct ws281x_trace_rec {
+	__u64 ts_ns;
+	__u32 first;
+	__u32 count;
+	__u16 op;
+	__u16 flags;
+	__u32 value;
+};
+
+#endif /* _WS281X_H */